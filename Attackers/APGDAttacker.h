@@ -0,0 +1,177 @@
+#pragma once
+#include <torch/torch.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "IAttacker.h"
+#include "Profiler.h"
+
+namespace nn = torch::nn;
+
+/// <summary>
+/// L-infinity APGD (Croce and Hein, 2020): PGD with momentum whose per-sample step size starts at 2 epsilon and is
+/// halved at fixed checkpoints when the objective stopped improving, restarting from the best point found. It
+/// needs no step-size tuning, which makes it the reference attack of worst-case evaluations. Returns, per sample,
+/// the first misclassified point found, or the point of highest objective when there is none.
+/// </summary>
+template <typename ModuleType>
+struct APGDAttacker : IAttacker<ModuleType>
+{
+	APGDAttacker(
+		double epsilon,
+		int iterations,
+		c10::Device device,
+		AttackLoss loss = AttackLoss::CrossEntropy,
+		int restarts = 1) :
+		_epsilon(epsilon), _iterations(std::max(1, iterations)), _device(device), _loss(loss), _restarts(std::max(1, restarts))
+	{}
+
+	virtual AttackType getType() { return AttackType::APGD; }
+
+	virtual std::string getDescription()
+	{
+		std::ostringstream description;
+		description << std::setprecision(17) << "apgd linf epsilon=" << _epsilon << " iterations=" << _iterations
+			<< " loss=" << attack_loss_name(_loss) << " restarts=" << _restarts << " input_range=" << _lower << "," << _upper;
+		return description.str();
+	}
+
+	virtual torch::Tensor operator()(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		torch::AutoGradMode _enable_grad(true);
+		network->eval();
+		return attack_with_restarts(network, input, labels, _restarts,
+			[&](const torch::Tensor& x, const torch::Tensor& y) { return attack(network, x, y); }).first;
+	}
+
+	virtual void to_device(c10::Device& device) { _device = device; }
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper)
+	{
+		if (lower >= upper) throw std::invalid_argument("the input range is empty");
+		_lower = lower;
+		_upper = upper;
+	}
+
+private:
+	/// per-sample objective and its input gradient at x
+	std::pair<torch::Tensor, torch::Tensor> evaluate(nn::ModuleHolder<ModuleType>& network, const torch::Tensor& x,
+		const torch::Tensor& labels, torch::Tensor& logits)
+	{
+		auto input = x.detach().requires_grad_();
+		torch::Tensor objective;
+		{ PROFILE_SCOPE("attack forward");
+			logits = network(input);
+			objective = attack_loss_per_sample(logits, labels, _loss);
+		}
+		PROFILE_SCOPE("attack backward");
+		auto gradient = torch::autograd::grad({ objective.sum() }, { input }, {}, false)[0];
+		logits = logits.detach();
+		return { objective.detach(), gradient };
+	}
+
+	/// <summary>
+	/// Iterations at which the step size may be halved: p_0 = 0, p_1 = 0.22, p_j+1 = p_j + max(p_j - p_j-1 - 0.03, 0.06),
+	/// scaled by the iteration count. For few iterations several fractions round to the same iteration; it is a
+	/// checkpoint once.
+	/// </summary>
+	std::vector<int> checkpoints() const
+	{
+		std::vector<int> points;
+		double previous = 0, current = 0.22;
+		while (current <= 1)
+		{
+			int point = static_cast<int>(std::ceil(current * _iterations));
+			if (points.empty() || point > points.back()) points.push_back(point);
+			double next = current + std::max(current - previous - 0.03, 0.06);
+			previous = current;
+			current = next;
+		}
+		return points;
+	}
+
+	torch::Tensor attack(nn::ModuleHolder<ModuleType>& network, const torch::Tensor& input, const torch::Tensor& labels)
+	{
+		const double alpha = 0.75, rho = 0.75;
+		auto per_sample = [&](const torch::Tensor& values) {
+			std::vector<int64_t> shape(input.dim(), 1);
+			shape[0] = -1;
+			return values.view(shape);
+		};
+		auto project = [&](const torch::Tensor& x) {
+			return torch::min(torch::max(x, input - _epsilon), input + _epsilon).clamp_(_lower, _upper);
+		};
+
+		torch::Tensor x, logits;
+		{ torch::NoGradGuard _no_grad_guard;
+			x = project(input + torch::empty_like(input).uniform_(-_epsilon, _epsilon));
+		}
+		torch::Tensor objective, gradient;
+		std::tie(objective, gradient) = evaluate(network, x, labels, logits);
+
+		torch::NoGradGuard _no_grad_guard;
+		auto step = torch::full({ input.size(0) }, 2 * _epsilon, input.options());
+		auto best = x.clone(), best_objective = objective.clone(), best_gradient = gradient.clone();
+		auto adversarial = x.clone();
+		auto success = logits.argmax(1).ne(labels);
+		auto improvements = torch::zeros({ input.size(0) }, input.options());
+		auto last_step = step.clone(), last_best_objective = best_objective.clone();
+		auto points = checkpoints();
+		size_t next_checkpoint = 0;
+		int last_checkpoint = 0;
+
+		auto previous = x.clone();
+		for (int k = 0; k < _iterations; ++k)
+		{
+			auto z = project(x + per_sample(step) * gradient.sign());
+			auto next = k == 0 ? z : project(x + alpha * (z - x) + (1 - alpha) * (x - previous));
+			previous = x;
+			x = next;
+
+			torch::Tensor next_objective;
+			{
+				torch::AutoGradMode _enable_grad(true);
+				std::tie(next_objective, gradient) = evaluate(network, x, labels, logits);
+			}
+			auto broken = logits.argmax(1).ne(labels).logical_and_(success.logical_not());
+			adversarial.masked_scatter_(per_sample(broken).expand_as(x), x.masked_select(per_sample(broken).expand_as(x)));
+			success.logical_or_(broken);
+
+			improvements.add_(next_objective.gt(objective).to(improvements.scalar_type()));
+			objective = next_objective;
+			auto better = objective.gt(best_objective);
+			best = torch::where(per_sample(better), x, best);
+			best_gradient = torch::where(per_sample(better), gradient, best_gradient);
+			best_objective = torch::where(better, objective, best_objective);
+
+			if (next_checkpoint < points.size() && k + 1 == points[next_checkpoint])
+			{
+				int window = k + 1 - last_checkpoint;
+				// halve where too few steps improved the objective, or where neither the step nor the best moved
+				auto halve = improvements.lt(rho * window).logical_or_(
+					last_step.eq(step).logical_and_(last_best_objective.eq(best_objective)));
+				last_step = step.clone();
+				last_best_objective = best_objective.clone();
+				step = torch::where(halve, step / 2, step);
+				x = torch::where(per_sample(halve), best, x);
+				gradient = torch::where(per_sample(halve), best_gradient, gradient);
+				improvements.zero_();
+				last_checkpoint = k + 1;
+				++next_checkpoint;
+			}
+		}
+		return torch::where(per_sample(success), adversarial, best);
+	}
+
+	double _epsilon;
+	int _iterations;
+	c10::Device _device;
+	AttackLoss _loss;
+	int _restarts;
+	double _lower = 0;
+	double _upper = 1;
+};
@@ -0,0 +1,187 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <torch/torch.h>
+#include "IAttacker.h"
+#include "datasets.h"
+
+/// ReadWrite attacks on a miss and stores the result; ReplayOnly only serves stored examples and throws on a miss
+enum AttackCacheMode { ReadWrite = 0, ReplayOnly };
+
+/// <summary>
+/// Serves adversarial examples from an on-disk cache in front of another attacker. An entry is keyed by a hash of
+/// the network's parameters and buffers, the wrapped attacker's description and a hash of the batch's inputs and
+/// labels, so re-evaluating the same weights against the same attack and data replays the stored examples instead
+/// of attacking again. Every entry is a file in the cache directory that is memory mapped on a hit; on the CPU the
+/// returned tensor views the private, copy-on-write mapping, so writing to it never changes the cached file.
+/// </summary>
+template <typename NetworkType>
+struct CachedAttacker : IAttacker<NetworkType>
+{
+	CachedAttacker(std::shared_ptr<IAttacker<NetworkType>> attacker, std::string directory, AttackCacheMode mode = AttackCacheMode::ReadWrite) :
+		_attacker(attacker), _directory(directory), _mode(mode), _description_hash(hash_string(attacker->getDescription()))
+	{}
+
+	virtual torch::Tensor operator()(nn::ModuleHolder<NetworkType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		auto path = entry_path(network, input, labels);
+		if (exists(path))
+		{
+			++_hits;
+			return replay(path, input);
+		}
+		if (_mode == AttackCacheMode::ReplayOnly)
+			throw std::runtime_error("no cached adversarial examples at " + path);
+
+		++_misses;
+		auto adversarial_input = (*_attacker)(network, input, labels);
+		store(path, adversarial_input);
+		return adversarial_input;
+	}
+
+	void to_device(c10::Device& device) { _attacker->to_device(device); }
+	virtual AttackType getType() { return _attacker->getType(); }
+	virtual std::string getDescription() { return _attacker->getDescription(); }
+	virtual const WorkspacePool* workspace() const { return _attacker->workspace(); }
+
+	int64_t hits() const { return _hits; }
+	int64_t misses() const { return _misses; }
+
+private:
+	struct EntryHeader
+	{
+		char magic[8];
+		uint32_t version;
+		int32_t dimensions;
+		int64_t sizes[8];
+		uint64_t data_offset;
+	};
+
+	static constexpr const char* kMagic = "YOPOADVX";
+	static constexpr uint32_t kVersion = 1;
+
+	static bool exists(const std::string& path) { return std::ifstream(path).good(); }
+
+	std::string entry_path(nn::ModuleHolder<NetworkType>& network, const torch::Tensor& input, const torch::Tensor& labels)
+	{
+		std::ostringstream name;
+		name << _directory << "/" << std::hex << std::setfill('0')
+			<< std::setw(16) << model_hash(network) << "-"
+			<< std::setw(16) << _description_hash << "-"
+			<< std::setw(16) << hash_tensor(labels, hash_tensor(input)) << ".adv";
+		return name.str();
+	}
+
+	/// hashes the weights once per set of tensor versions, so repeated batches of one evaluation hash them once
+	uint64_t model_hash(nn::ModuleHolder<NetworkType>& network)
+	{
+		auto tensors = network->parameters();
+		for (auto& buffer : network->buffers())
+			tensors.push_back(buffer);
+
+		std::vector<std::pair<const void*, int64_t>> versions;
+		for (auto& tensor : tensors)
+			versions.emplace_back(tensor.data_ptr(), static_cast<int64_t>(tensor._version()));
+		if (versions != _model_versions)
+		{
+			uint64_t hash = kOffsetBasis;
+			for (auto& tensor : tensors)
+				hash = hash_tensor(tensor, hash);
+			_model_versions = versions;
+			_model_hash = hash;
+		}
+		return _model_hash;
+	}
+
+	torch::Tensor replay(const std::string& path, const torch::Tensor& input)
+	{
+		auto file = std::make_shared<MappedFile>(path);
+		EntryHeader header;
+		if (file->size() < sizeof(header)) throw std::runtime_error("truncated adversarial cache entry " + path);
+		std::memcpy(&header, file->data(), sizeof(header));
+		std::vector<int64_t> sizes(header.sizes, header.sizes + std::min(header.dimensions, 8));
+		if (std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kVersion ||
+			sizes != input.sizes().vec() ||
+			file->size() < header.data_offset + input.numel() * sizeof(float))
+			throw std::runtime_error("invalid adversarial cache entry " + path);
+
+		auto keep_alive = [file](void*) {};
+		auto stored = torch::from_blob(file->data() + header.data_offset, sizes, keep_alive, torch::kFloat32);
+		return stored.to(input.device(), input.scalar_type()).contiguous(input.suggest_memory_format());
+	}
+
+	/// writes next to the destination and renames, so a partially written entry is never replayed
+	void store(const std::string& path, const torch::Tensor& adversarial_input)
+	{
+		auto values = adversarial_input.detach().to(torch::kCPU, torch::kFloat32).contiguous();
+		if (values.dim() > 8) throw std::invalid_argument("adversarial cache entries have at most 8 dimensions");
+
+		EntryHeader header = {};
+		std::memcpy(header.magic, kMagic, sizeof(header.magic));
+		header.version = kVersion;
+		header.dimensions = static_cast<int32_t>(values.dim());
+		for (int64_t d = 0; d < values.dim(); ++d)
+			header.sizes[d] = values.size(d);
+		header.data_offset = 64 * ((sizeof(header) + 63) / 64);
+
+		auto temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			if (!out) throw std::runtime_error("unable to create " + temporary);
+			std::vector<char> padding(header.data_offset - sizeof(header), 0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(padding.data(), padding.size());
+			out.write(reinterpret_cast<const char*>(values.data_ptr<float>()), values.numel() * sizeof(float));
+			if (!out) throw std::runtime_error("unable to write " + temporary);
+		}
+		std::remove(path.c_str());
+		if (std::rename(temporary.c_str(), path.c_str()) != 0)
+			throw std::runtime_error("unable to move " + temporary + " to " + path);
+	}
+
+	// 64-bit FNV-1a over the tensor's shape, type and bytes
+	static constexpr uint64_t kOffsetBasis = 14695981039346656037ull;
+	static constexpr uint64_t kPrime = 1099511628211ull;
+
+	static uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t hash)
+	{
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ data[i]) * kPrime;
+		return hash;
+	}
+
+	static uint64_t hash_string(const std::string& value)
+	{
+		return hash_bytes(reinterpret_cast<const uint8_t*>(value.data()), value.size(), kOffsetBasis);
+	}
+
+	static uint64_t hash_tensor(const torch::Tensor& tensor, uint64_t hash = kOffsetBasis)
+	{
+		auto values = tensor.detach().to(torch::kCPU).contiguous();
+		auto sizes = values.sizes().vec();
+		auto type = static_cast<int32_t>(values.scalar_type());
+		hash = hash_bytes(reinterpret_cast<const uint8_t*>(sizes.data()), sizes.size() * sizeof(int64_t), hash);
+		hash = hash_bytes(reinterpret_cast<const uint8_t*>(&type), sizeof(type), hash);
+		return hash_bytes(static_cast<const uint8_t*>(values.data_ptr()), values.numel() * values.element_size(), hash);
+	}
+
+	std::shared_ptr<IAttacker<NetworkType>> _attacker;
+	std::string _directory;
+	AttackCacheMode _mode;
+	uint64_t _description_hash;
+
+	std::vector<std::pair<const void*, int64_t>> _model_versions;
+	uint64_t _model_hash = 0;
+
+	int64_t _hits = 0;
+	int64_t _misses = 0;
+};
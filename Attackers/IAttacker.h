@@ -1,6 +1,11 @@
 #pragma once
 #include <torch/torch.h>
+#include <limits>
+#include <string>
+#include <unordered_set>
+#include <utility>
 #include <vector>
+#include "WorkspacePool.h"
 
 namespace nn = torch::nn;
 
@@ -8,18 +13,71 @@ enum AttackType
 {
 	Noop = 0,
 	PGD,
-	YOPO
+	YOPO,
+	APGD
 };
 
+/// the objective an attack ascends: cross-entropy, or the Carlini-Wagner margin max_{j != y} z_j - z_y
+enum AttackLoss { CrossEntropy = 0, CWMargin };
+
 template <typename ModuleType>
 struct IAttacker
 {
 	virtual torch::Tensor operator()(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels) = 0;
 	virtual void to_device(c10::Device& device) = 0;
 	virtual AttackType getType() = 0;
+	/// every setting that changes the examples the attack produces; attacks with equal descriptions are interchangeable
+	virtual std::string getDescription() = 0;
+	/// the pool the attack draws its temporaries from, if it keeps one
+	virtual const WorkspacePool* workspace() const { return nullptr; }
 };
 
-torch::Tensor clip_eta(torch::Tensor eta, char norm = '1', double eps = std::numeric_limits<double>::epsilon())
+/// per-sample attack objective of the logits
+inline torch::Tensor attack_loss_per_sample(const torch::Tensor& logits, const torch::Tensor& labels, AttackLoss loss)
+{
+	if (loss == AttackLoss::CrossEntropy)
+		return torch::nn::functional::cross_entropy(
+			logits, labels, torch::nn::functional::CrossEntropyFuncOptions().reduction(torch::kNone));
+
+	auto correct = logits.gather(1, labels.unsqueeze(1)).squeeze(1);
+	auto others = logits.scatter(1, labels.unsqueeze(1), -std::numeric_limits<float>::infinity());
+	return std::get<0>(others.max(1)) - correct;
+}
+
+inline const char* attack_loss_name(AttackLoss loss) { return loss == AttackLoss::CrossEntropy ? "ce" : "cw"; }
+
+/// <summary>
+/// Runs attack up to restarts times, each time only on the samples that no earlier run misclassified. Returns the
+/// adversarial batch, holding the first successful perturbation of every sample and the last run's perturbation
+/// of the others, and the per-sample success flags.
+/// </summary>
+template <typename ModuleType, typename AttackFunction>
+std::pair<torch::Tensor, torch::Tensor> attack_with_restarts(
+	nn::ModuleHolder<ModuleType> network,
+	torch::Tensor input,
+	torch::Tensor labels,
+	int restarts,
+	AttackFunction attack)
+{
+	auto adversarial_input = attack(input, labels).detach();
+	torch::Tensor success;
+	{ torch::NoGradGuard _no_grad_guard;
+		success = network(adversarial_input).argmax(1).ne(labels);
+	}
+	for (int restart = 1; restart < restarts; ++restart)
+	{
+		auto remaining = success.logical_not().nonzero().squeeze(1);
+		if (remaining.size(0) == 0) break;
+		auto retried = attack(input.index_select(0, remaining), labels.index_select(0, remaining)).detach();
+
+		torch::NoGradGuard _no_grad_guard;
+		adversarial_input.index_copy_(0, remaining, retried);
+		success.index_copy_(0, remaining, network(retried).argmax(1).ne(labels.index_select(0, remaining)));
+	}
+	return { adversarial_input, success };
+}
+
+inline torch::Tensor clip_eta(torch::Tensor eta, char norm = '1', double eps = std::numeric_limits<double>::epsilon())
 {
 	torch::NoGradGuard _no_grad_guard;
 	if (std::unordered_set<char>({ '1', '2', 'I' }).count(norm) < 1)
@@ -35,7 +93,7 @@ torch::Tensor clip_eta(torch::Tensor eta, char norm = '1', double eps = std::num
 
 	auto normalize = torch::norm(eta.reshape({ eta.size(0), -1 }), norm == '1' ? 1 : 2, -1, false);
 	normalize = torch::max(normalize, eps_tensor);
-	for (int i = 0; i < 3; ++i);
+	for (int d = 1; d < eta.dim(); ++d)
 		normalize.unsqueeze_(-1);
 
 	auto factor = torch::min(one_tensor, eps_tensor / normalize);
@@ -15,5 +15,6 @@ struct NoopAttacker : IAttacker<NetworkType>
 
 	void to_device(c10::Device& device) {}
 	virtual AttackType getType() { return AttackType::Noop; }
+	virtual std::string getDescription() { return "noop"; }
 
 };
\ No newline at end of file
@@ -1,9 +1,23 @@
 #pragma once
 #include <torch/torch.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
 #include <vector>
+#include "Profiler.h"
+#include "MixedPrecision.h"
+#include "utilities.h"
+#include "WorkspacePool.h"
 
 namespace nn = torch::nn;
 
+enum PGDExecutionMode
+{
+	Reference = 0,
+	InPlace
+};
+
 template <typename ModuleType>
 struct PGDAttacker : IAttacker<ModuleType>
 {
@@ -11,35 +25,85 @@ struct PGDAttacker : IAttacker<ModuleType>
 		double epsilon,
 		double sigma,
 		int iterations,
-		c10::Device device) :
-		_epsilon(epsilon), _sigma(sigma), _iterations(iterations), _device(device)
+		c10::Device device,
+		PGDExecutionMode mode = PGDExecutionMode::Reference,
+		bool early_stopping = false,
+		ComputePrecision precision = ComputePrecision::FP32) :
+		_epsilon(epsilon), _sigma(sigma), _iterations(iterations), _device(device), _mode(mode), _early_stopping(early_stopping),
+		_precision(precision)
 	{
 		_cel = torch::nn::CrossEntropyLoss();
 		_cel->to(device);
 	}
 	virtual AttackType getType() { return AttackType::PGD; }
 
+	/// the execution mode and micro-batching only change how the same attack is computed, so they are left out
+	virtual std::string getDescription()
+	{
+		std::ostringstream description;
+		description << std::setprecision(17) << "pgd linf epsilon=" << _epsilon << " sigma=" << _sigma
+			<< " iterations=" << _iterations << " early_stopping=" << _early_stopping
+			<< " precision=" << (_precision == ComputePrecision::BF16 ? "bf16" : "fp32")
+			<< " loss=" << attack_loss_name(_loss) << " restarts=" << _restarts
+			<< " input_range=" << _lower << "," << _upper;
+		return description.str();
+	}
+
 	virtual torch::Tensor operator()(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
 	{
+		// the attack differentiates through the network even when the caller evaluates under a NoGradGuard
+		torch::AutoGradMode _enable_grad(true);
+		if (_precision == ComputePrecision::BF16)
+			prepare_replica(network);
+		if (_restarts > 1)
+		{
+			auto result = attack_with_restarts(network, input, labels, _restarts,
+				[&](const torch::Tensor& x, const torch::Tensor& y) { return single_run(network, x, y); });
+			_success = result.second;
+			return result.first;
+		}
+		return single_run(network, input, labels);
+	}
+
+	/// the objective the attack ascends; cross-entropy by default
+	void set_loss(AttackLoss loss) { _loss = loss; }
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper)
+	{
+		if (lower >= upper) throw std::invalid_argument("the input range is empty");
+		_lower = lower;
+		_upper = upper;
+	}
+
+	/// <summary>
+	/// Repeats the attack from fresh random starts up to restarts times, each time only on the samples that are
+	/// still classified correctly. last_success() then reports success over all restarts.
+	/// </summary>
+	void set_restarts(int restarts) { _restarts = std::max(1, restarts); }
+
+	/// <summary>
+	/// Attacks batches in chunks of at most microBatchSize samples, one after the other, so the autograd graph of
+	/// only one chunk is alive at a time. Every sample's perturbation depends only on that sample, so the result is
+	/// the same as attacking the whole batch. 0 disables micro-batching.
+	/// </summary>
+	void set_micro_batch_size(int64_t microBatchSize) { _micro_batch_size = microBatchSize; }
+
+	torch::Tensor attack(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		if (_early_stopping)
+			return early_stopping_attack(network, input, labels);
+		if (_mode == PGDExecutionMode::InPlace)
+			return in_place_attack(network, input, labels);
+
+		// eta is drawn on the input's device; the network and labels are expected there too
 		auto eta = (torch::rand_like(input) - 0.5) * 2 * _epsilon;
-		double standard_deviation = 1; //torch::ones({ 1, 1, 1, 1 }); standard_deviation.to(_device);
-		double mean = 0; // torch::zeros({ 1, 1, 1, 1 }); mean.to(_device);
-		std::cout << torch::ones({ 1, 1, 1, 1 }) << std::endl;
-		std::cout << torch::zeros({ 1, 1, 1, 1 }) << std::endl;
-		//std::cout << eta << std::endl;
-		eta.to(_device);
-		eta = (eta - mean) / standard_deviation;
 		network->eval();
 		for (int i = 0; i < _iterations; ++i)
 		{
 			eta = single_iteration(network, input, labels, eta);
 		}
-
-		auto adversarial_input = input + eta;
-		auto tmp_adversarial_input = adversarial_input * standard_deviation + mean;
-		tmp_adversarial_input = torch::clamp(tmp_adversarial_input, 0, 1);
-		adversarial_input = (tmp_adversarial_input - mean) + standard_deviation;
-		return adversarial_input;
+		return torch::clamp(input + eta, _lower, _upper);
 	}
 
 	torch::Tensor single_iteration(
@@ -48,37 +112,215 @@ struct PGDAttacker : IAttacker<ModuleType>
 		torch::Tensor label,
 		torch::Tensor eta)
 	{
-		input.to(_device);
-		label.to(_device);
-		eta.to(_device);
 		if (!input.is_same_size(eta)) throw std::invalid_argument("Input and eta must be the same size");
-		auto standard_deviation = torch::ones({ 1, 1, 1, 1 }); standard_deviation.to(_device);
-		auto mean = torch::zeros({ 1, 1, 1, 1 }); mean.to(_device);
-		auto adversarial_input = torch::Tensor(input + eta).to(_device);
-		std::cout << mean.get_device() <<  " " << _device << " AI device " << adversarial_input.get_device() << std::endl;
-		auto prediction = network(adversarial_input); prediction.to(_device);
-		auto loss = _cel(prediction, label); loss.to(_device);
-		std::cout << torch::Device("cuda:0") << std::endl;
-		adversarial_input.to(torch::Device("cuda:0"));
-		std::cout << adversarial_input.get_device() << std::endl;
-		//if (input.get_device() != _device || adversarial_input.get_device() != _device) throw std::invalid_argument("");
-		auto grad_sign_pre = torch::autograd::grad({ loss }, { adversarial_input }, {}, false);
-		auto grad_sign = grad_sign_pre[0].sign(); grad_sign.to(_device);
-		adversarial_input = adversarial_input + grad_sign * (_sigma / standard_deviation);
-		auto tmp_adversarial_input = torch::clamp_(adversarial_input * standard_deviation + mean);
-		auto tmp_input = input * standard_deviation + mean;
-		auto tmp_eta = clip_eta(tmp_adversarial_input - tmp_input, 'I', _epsilon);
-		eta = tmp_eta / standard_deviation;
-		return eta;
+		auto adversarial_input = (input + eta).requires_grad_();
+		torch::Tensor loss;
+		{ PROFILE_SCOPE("attack forward");
+			loss = objective(predict(network, adversarial_input), label);
+		}
+		std::vector<torch::Tensor> gradient;
+		{ PROFILE_SCOPE("attack backward");
+			gradient = torch::autograd::grad({ loss }, { adversarial_input }, {}, false);
+		}
+		adversarial_input = adversarial_input.detach() + gradient[0].sign() * _sigma;
+		adversarial_input.clamp_(_lower, _upper);
+		return clip_eta(adversarial_input - input, 'I', _epsilon);
 	}
 
-	virtual void to_device(c10::Device& device) { _cel->to(_device); }
+	/// <summary>
+	/// Runs the attack on workspaces drawn from the attacker's pool and updated in place; they go back to the pool
+	/// afterwards, so batches of a shape seen before allocate none. Nothing inside the iteration loop allocates
+	/// workspace tensors, synchronizes with the host or prints.
+	/// </summary>
+	torch::Tensor in_place_attack(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		auto eta = _workspace.acquire_like(input);
+		auto adversarial_workspace = _workspace.acquire_like(input);
+		auto gradient_sign = _workspace.acquire_like(input);
+		network->eval();
+		{ torch::NoGradGuard _no_grad_guard;
+			eta.uniform_(-_epsilon, _epsilon);
+		}
+
+		for (int i = 0; i < _iterations; ++i)
+		{
+			torch::Tensor gradient;
+			{
+				{ torch::NoGradGuard _no_grad_guard;
+					torch::add_out(adversarial_workspace, input, eta);
+				}
+				auto adversarial_input = adversarial_workspace.detach().requires_grad_();
+				torch::Tensor loss;
+				{ PROFILE_SCOPE("attack forward");
+					loss = objective(predict(network, adversarial_input), labels);
+				}
+				PROFILE_SCOPE("attack backward");
+				gradient = torch::autograd::grad({ loss }, { adversarial_input }, {}, false)[0];
+			}
+
+			torch::NoGradGuard _no_grad_guard;
+			torch::sign_out(gradient_sign, gradient);
+			adversarial_workspace.add_(gradient_sign, _sigma).clamp_(_lower, _upper);
+			torch::sub_out(eta, adversarial_workspace, input).clamp_(-_epsilon, _epsilon);
+		}
+
+		torch::NoGradGuard _no_grad_guard;
+		auto adversarial_input = torch::clamp(input + eta, _lower, _upper);
+		_workspace.release(std::move(eta));
+		_workspace.release(std::move(adversarial_workspace));
+		_workspace.release(std::move(gradient_sign));
+		return adversarial_input;
+	}
+
+	/// <summary>
+	/// Runs the attack only on the samples that are still classified correctly. Samples that are misclassified
+	/// after a step keep that perturbation and are dropped from the batch, so later forward and backward passes
+	/// run on a smaller tensor. The point after the final step gets one more forward-only check, so a sample that
+	/// step broke counts as a success. The returned adversarial batch always has the full input size.
+	/// </summary>
+	torch::Tensor early_stopping_attack(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		network->eval();
+		torch::Tensor eta;
+		{ torch::NoGradGuard _no_grad_guard;
+			eta = _workspace.acquire_like(input).uniform_(-_epsilon, _epsilon);
+			// every checked point lies in the input range, so it is the point that is returned
+			eta.add_(input).clamp_(_lower, _upper).sub_(input);
+		}
+		auto active = torch::arange(input.size(0), labels.options().dtype(torch::kLong));
+		auto active_input = input;
+		auto active_labels = labels;
+		_success = torch::zeros({ input.size(0) }, labels.options().dtype(torch::kBool));
+		_propagated_samples = 0;
+
+		for (int i = 0; i <= _iterations && active.size(0) > 0; ++i)
+		{
+			bool stepping = i < _iterations;
+			auto adversarial_input = (active_input + eta.index_select(0, active)).detach().requires_grad_(stepping);
+			torch::Tensor prediction;
+			{ PROFILE_SCOPE("attack forward");
+				prediction = predict(network, adversarial_input);
+			}
+			_propagated_samples += active.size(0);
+
+			auto correct = prediction.detach().argmax(1).eq(active_labels);
+			auto keep = correct.nonzero().squeeze(1);
+			_success.index_fill_(0, active.masked_select(correct.logical_not()), true);
+			if (keep.size(0) == 0 || !stepping) break;
+
+			torch::Tensor gradient;
+			{ PROFILE_SCOPE("attack backward");
+				auto loss = objective(prediction.index_select(0, keep), active_labels.index_select(0, keep));
+				gradient = torch::autograd::grad({ loss }, { adversarial_input }, {}, false)[0].index_select(0, keep);
+			}
+
+			torch::NoGradGuard _no_grad_guard;
+			active = active.index_select(0, keep);
+			active_input = active_input.index_select(0, keep);
+			active_labels = active_labels.index_select(0, keep);
+			auto stepped = adversarial_input.detach().index_select(0, keep).add_(gradient.sign_(), _sigma).clamp_(_lower, _upper);
+			eta.index_copy_(0, active, stepped.sub_(active_input).clamp_(-_epsilon, _epsilon));
+		}
+
+		torch::NoGradGuard _no_grad_guard;
+		auto adversarial_input = torch::clamp(input + eta, _lower, _upper);
+		_workspace.release(std::move(eta));
+		return adversarial_input;
+	}
+
+	/// per-sample flags of the last early-stopping attack, set for samples it misclassified at any checked point
+	torch::Tensor last_success() { return _success; }
+
+	/// number of per-sample forward passes the last early-stopping attack ran; all but the final check's had a backward pass
+	long long last_propagated_samples() { return _propagated_samples; }
+
+	virtual void to_device(c10::Device& device)
+	{
+		_device = device;
+		_cel->to(device);
+	}
+
+	virtual const WorkspacePool* workspace() const { return &_workspace; }
 
 private:
+	torch::Tensor single_run(nn::ModuleHolder<ModuleType>& network, const torch::Tensor& input, const torch::Tensor& labels)
+	{
+		if (_micro_batch_size > 0 && input.size(0) > _micro_batch_size)
+			return micro_batched_attack(network, input, labels);
+		return attack(network, input, labels);
+	}
+
+	/// the mean objective over the batch; the gradient only contributes its sign, so the scale is irrelevant
+	torch::Tensor objective(const torch::Tensor& prediction, const torch::Tensor& labels)
+	{
+		if (_loss == AttackLoss::CrossEntropy) return _cel(prediction, labels);
+		return attack_loss_per_sample(prediction, labels, _loss).mean();
+	}
+
+	torch::Tensor micro_batched_attack(nn::ModuleHolder<ModuleType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		std::vector<torch::Tensor> adversarial_chunks, success_chunks;
+		long long propagated_samples = 0;
+		for (auto& chunk : split_batch(input, labels, _micro_batch_size))
+		{
+			adversarial_chunks.push_back(attack(network, chunk.data, chunk.target));
+			if (_early_stopping)
+			{
+				success_chunks.push_back(_success);
+				propagated_samples += _propagated_samples;
+			}
+		}
+		if (_early_stopping)
+		{
+			_success = torch::cat(success_chunks);
+			_propagated_samples = propagated_samples;
+		}
+		return torch::cat(adversarial_chunks);
+	}
+
+	/// in BF16 the forward and backward passes run on a bfloat16 replica; perturbations and projections stay in
+	/// fp32 and the gradient only contributes its sign
+	torch::Tensor predict(nn::ModuleHolder<ModuleType>& network, const torch::Tensor& x)
+	{
+		return _replica ? (*_replica)(x) : network(x);
+	}
+
+	/// the replica follows the network the attacker is used on, with its latest weights
+	void prepare_replica(nn::ModuleHolder<ModuleType>& network)
+	{
+		if (!_replica || _replica_source != network.ptr().get())
+		{
+			_replica = std::make_unique<LowPrecisionReplica<ModuleType>>(network);
+			_replica_source = network.ptr().get();
+		}
+		else
+		{
+			_replica->pull();
+		}
+		_replica->replica()->eval();
+	}
+
 	double _epsilon;
 	double _sigma;
 	int _iterations;
 	torch::nn::CrossEntropyLoss _cel;
 	c10::Device _device;
+	PGDExecutionMode _mode;
+	bool _early_stopping;
+	ComputePrecision _precision;
+	int64_t _micro_batch_size = 0;
+	AttackLoss _loss = AttackLoss::CrossEntropy;
+	int _restarts = 1;
+	double _lower = 0;
+	double _upper = 1;
+	std::unique_ptr<LowPrecisionReplica<ModuleType>> _replica;
+	const ModuleType* _replica_source = nullptr;
+
+	// perturbation, adversarial input and gradient sign buffers of the in-place and early-stopping attacks, kept
+	// across batches; micro-batches, restarts and the last batch of an epoch each add their own shape
+	WorkspacePool _workspace;
 
+	// early stopping statistics
+	torch::Tensor _success;
+	long long _propagated_samples = 0;
 };
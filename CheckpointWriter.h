@@ -0,0 +1,112 @@
+#pragma once
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <torch/torch.h>
+
+/// <summary>
+/// Writes checkpoints from a background thread. write() serializes the archive into host memory on the calling
+/// thread, which is all training waits for; the writer thread stores the bytes next to the destination and renames
+/// them over it, so an interrupted write never leaves a truncated checkpoint behind. When a newer snapshot arrives
+/// before the previous one reached the disk, only the newer one is written.
+/// </summary>
+class AsyncCheckpointWriter
+{
+public:
+	AsyncCheckpointWriter(const std::string& path) : _path(path), _thread([this]() { run(); }) {}
+
+	~AsyncCheckpointWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_changed.notify_all();
+		_thread.join();
+	}
+
+	AsyncCheckpointWriter(const AsyncCheckpointWriter&) = delete;
+	AsyncCheckpointWriter& operator=(const AsyncCheckpointWriter&) = delete;
+
+	/// snapshots the archive; throws if a previous background write failed
+	void write(torch::serialize::OutputArchive& archive)
+	{
+		std::ostringstream stream;
+		archive.save_to(stream);
+		auto bytes = std::make_unique<std::string>(stream.str());
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		rethrow_error();
+		_pending = std::move(bytes);
+		_changed.notify_all();
+	}
+
+	/// blocks until the latest snapshot is on disk
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait(lock, [&]() { return !_pending && !_writing; });
+		rethrow_error();
+	}
+
+	static bool exists(const std::string& path) { return std::ifstream(path).good(); }
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (true)
+		{
+			_changed.wait(lock, [&]() { return _stopping || _pending; });
+			if (!_pending) return;
+
+			auto bytes = std::move(_pending);
+			_writing = true;
+			lock.unlock();
+			std::exception_ptr error;
+			try { write_file(*bytes); }
+			catch (...) { error = std::current_exception(); }
+			lock.lock();
+
+			_writing = false;
+			if (error) _error = error;
+			_changed.notify_all();
+		}
+	}
+
+	void write_file(const std::string& bytes)
+	{
+		auto temporary = _path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			out.write(bytes.data(), bytes.size());
+			if (!out) throw std::runtime_error("unable to write checkpoint " + temporary);
+		}
+		std::remove(_path.c_str());
+		if (std::rename(temporary.c_str(), _path.c_str()) != 0)
+			throw std::runtime_error("unable to move " + temporary + " to " + _path);
+	}
+
+	void rethrow_error()
+	{
+		if (!_error) return;
+		auto error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+
+	std::string _path;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::unique_ptr<std::string> _pending;
+	std::exception_ptr _error;
+	bool _writing = false;
+	bool _stopping = false;
+	std::thread _thread;
+};
@@ -0,0 +1,327 @@
+#pragma once
+#ifndef _WIN32
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <torch/torch.h>
+#include "ExperimentScheduler.h"
+
+/// parses a Linux cpulist such as "0-15,32-47"
+inline std::vector<int> parse_cpulist(const std::string& list)
+{
+	std::vector<int> cores;
+	std::stringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ','))
+	{
+		if (range.find_first_of("0123456789") == std::string::npos) continue;
+		auto dash = range.find('-');
+		int first = std::stoi(range.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		for (int core = first; core <= last; ++core)
+			cores.push_back(core);
+	}
+	return cores;
+}
+
+/// the cores of every NUMA node that has any; one node holding every core when sysfs does not describe them
+inline std::vector<std::vector<int>> numa_node_cores()
+{
+	std::vector<std::pair<int, std::vector<int>>> nodes;
+	if (DIR* directory = opendir("/sys/devices/system/node"))
+	{
+		while (dirent* entry = readdir(directory))
+		{
+			std::string name = entry->d_name;
+			if (name.rfind("node", 0) != 0 || name.find_first_not_of("0123456789", 4) != std::string::npos || name.size() == 4)
+				continue;
+			std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+			std::string list;
+			if (std::getline(file, list) && !parse_cpulist(list).empty())
+				nodes.emplace_back(std::stoi(name.substr(4)), parse_cpulist(list));
+		}
+		closedir(directory);
+	}
+	std::sort(nodes.begin(), nodes.end());
+
+	std::vector<std::vector<int>> cores;
+	for (auto& node : nodes)
+		cores.push_back(node.second);
+	if (cores.empty())
+	{
+		cores.emplace_back();
+		int count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		for (int core = 0; core < count; ++core)
+			cores.back().push_back(core);
+	}
+	return cores;
+}
+
+/// <summary>
+/// Splits the machine's cores between workers. With at least as many NUMA nodes as workers every worker gets whole
+/// nodes; otherwise the cores, in node order, are cut into equal contiguous ranges so that a worker spans as few
+/// nodes as possible.
+/// </summary>
+inline std::vector<std::vector<int>> worker_core_sets(int workers)
+{
+	auto nodes = numa_node_cores();
+	std::vector<std::vector<int>> sets(workers);
+	if (static_cast<int>(nodes.size()) >= workers)
+	{
+		for (size_t node = 0; node < nodes.size(); ++node)
+			sets[node % workers].insert(sets[node % workers].end(), nodes[node].begin(), nodes[node].end());
+		return sets;
+	}
+
+	std::vector<int> cores;
+	for (auto& node : nodes)
+		cores.insert(cores.end(), node.begin(), node.end());
+	for (int w = 0; w < workers; ++w)
+	{
+		size_t begin = cores.size() * w / workers;
+		size_t end = std::max(begin + 1, cores.size() * (w + 1) / workers);
+		for (size_t i = begin; i < end; ++i)
+			sets[w].push_back(cores[i % cores.size()]);
+	}
+	return sets;
+}
+
+/// <summary>
+/// Collective operations between the worker processes of one machine over an anonymous shared mapping created
+/// before they are forked. Every rank owns a float slot that holds its flattened gradients; all_reduce_gradients
+/// sums the slots into a shared result, each rank reducing its own range of it, and averages. The mapping is
+/// reserved for capacity floats per slot up front and only the pages in use are ever touched.
+/// </summary>
+class SharedMemoryGroup
+{
+public:
+	SharedMemoryGroup(int worldSize, size_t capacity = size_t(1) << 26) :
+		_worldSize(worldSize),
+		_capacity(capacity)
+	{
+		if (worldSize < 1) throw std::invalid_argument("a process group needs at least one worker");
+		_bytes = kSlotOffset + (worldSize + 1) * capacity * sizeof(float);
+		void* memory = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (memory == MAP_FAILED) throw std::runtime_error("unable to map shared memory for the process group");
+		_memory = static_cast<uint8_t*>(memory);
+		_header = new (_memory) Header();
+	}
+
+	~SharedMemoryGroup()
+	{
+		_header->~Header();
+		munmap(_memory, _bytes);
+	}
+
+	SharedMemoryGroup(const SharedMemoryGroup&) = delete;
+	SharedMemoryGroup& operator=(const SharedMemoryGroup&) = delete;
+
+	void set_rank(int rank) { _rank = rank; }
+	int rank() const { return _rank; }
+	int world_size() const { return _worldSize; }
+
+	/// marks the group failed; every rank waiting in a collective throws instead of waiting forever
+	void abort() { _header->failed.store(true, std::memory_order_release); }
+
+	/// <summary>
+	/// Waits until every rank has arrived. Ranks usually arrive within microseconds of each other, so a waiting rank
+	/// spins briefly, then yields, and only then sleeps, doubling the sleep up to a millisecond, so that a rank left
+	/// waiting on a slow one, e.g. during its evaluation, does not burn a core.
+	/// </summary>
+	void barrier()
+	{
+		const int kSpins = 1000, kYields = 1000;
+		const auto kMaxSleep = std::chrono::microseconds(1000);
+
+		int generation = _header->generation.load(std::memory_order_acquire);
+		if (_header->arrived.fetch_add(1, std::memory_order_acq_rel) == _worldSize - 1)
+		{
+			_header->arrived.store(0, std::memory_order_relaxed);
+			_header->generation.fetch_add(1, std::memory_order_release);
+			return;
+		}
+		auto sleep = std::chrono::microseconds(10);
+		for (int waits = 0; _header->generation.load(std::memory_order_acquire) == generation; ++waits)
+		{
+			if (_header->failed.load(std::memory_order_acquire))
+				throw std::runtime_error("another data-parallel worker failed");
+			if (waits < kSpins) continue;
+			if (waits < kSpins + kYields)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			std::this_thread::sleep_for(sleep);
+			sleep = std::min(sleep * 2, kMaxSleep);
+		}
+	}
+
+	/// averages the parameters' gradients over the group; a missing gradient counts as zeros
+	void all_reduce_gradients(const std::vector<torch::Tensor>& parameters)
+	{
+		if (_worldSize == 1) return;
+		torch::NoGradGuard _nogradguard;
+		auto total = count(parameters);
+		auto local = slot(_rank, total);
+		int64_t offset = 0;
+		for (auto& parameter : parameters)
+		{
+			auto destination = local.narrow(0, offset, parameter.numel());
+			if (parameter.grad().defined()) destination.copy_(parameter.grad().reshape({ -1 }));
+			else destination.zero_();
+			offset += parameter.numel();
+		}
+		barrier();
+
+		int64_t begin = total * _rank / _worldSize;
+		int64_t length = total * (_rank + 1) / _worldSize - begin;
+		auto reduced = slot(_worldSize, total).narrow(0, begin, length);
+		reduced.copy_(slot(0, total).narrow(0, begin, length));
+		for (int r = 1; r < _worldSize; ++r)
+			reduced.add_(slot(r, total).narrow(0, begin, length));
+		reduced.div_(_worldSize);
+		barrier();
+
+		// the next call only writes the result after every rank has passed its first barrier, i.e. read this one
+		auto result = slot(_worldSize, total);
+		offset = 0;
+		for (auto& parameter : parameters)
+		{
+			auto source = result.narrow(0, offset, parameter.numel()).view(parameter.sizes());
+			if (parameter.grad().defined()) parameter.mutable_grad().copy_(source);
+			else parameter.mutable_grad() = source.to(parameter.options(), /*non_blocking*/ false, /*copy*/ true);
+			offset += parameter.numel();
+		}
+	}
+
+	/// copies rank 0's values of the tensors into every other rank's
+	void broadcast(const std::vector<torch::Tensor>& tensors)
+	{
+		if (_worldSize == 1) return;
+		torch::NoGradGuard _nogradguard;
+		auto total = count(tensors);
+		auto shared = slot(0, total);
+		int64_t offset = 0;
+		if (_rank == 0)
+			for (auto& tensor : tensors)
+			{
+				shared.narrow(0, offset, tensor.numel()).copy_(tensor.reshape({ -1 }));
+				offset += tensor.numel();
+			}
+		barrier();
+		if (_rank != 0)
+			for (auto& tensor : tensors)
+			{
+				tensor.copy_(shared.narrow(0, offset, tensor.numel()).view(tensor.sizes()));
+				offset += tensor.numel();
+			}
+		// rank 0 must not reuse its slot before everyone has read it
+		barrier();
+	}
+
+private:
+	struct Header
+	{
+		std::atomic<int> arrived{ 0 };
+		std::atomic<int> generation{ 0 };
+		std::atomic<bool> failed{ false };
+	};
+	static constexpr size_t kSlotOffset = 4096;
+
+	int64_t count(const std::vector<torch::Tensor>& tensors) const
+	{
+		int64_t total = 0;
+		for (auto& tensor : tensors)
+			total += tensor.numel();
+		if (static_cast<size_t>(total) > _capacity)
+			throw std::invalid_argument("tensors exceed the process group's shared memory capacity");
+		return total;
+	}
+
+	torch::Tensor slot(int index, int64_t numel)
+	{
+		auto data = _memory + kSlotOffset + index * _capacity * sizeof(float);
+		return torch::from_blob(data, { numel }, torch::kFloat32);
+	}
+
+	int _worldSize;
+	int _rank = 0;
+	size_t _capacity;
+	size_t _bytes;
+	uint8_t* _memory;
+	Header* _header;
+};
+
+/// <summary>
+/// Runs body in worldSize forked worker processes that share a SharedMemoryGroup. Each worker is pinned to its
+/// cores from worker_core_sets and runs as many intra-op threads as it has cores. Call this before libtorch has
+/// started thread pools or initialized CUDA: a forked child inherits neither. Returns once every worker has
+/// exited and throws if any of them failed.
+/// </summary>
+inline void run_data_parallel(int worldSize, std::function<void(SharedMemoryGroup&)> body, size_t capacity = size_t(1) << 26)
+{
+	SharedMemoryGroup group(worldSize, capacity);
+	auto core_sets = worker_core_sets(worldSize);
+	std::cout << std::flush;
+
+	std::vector<pid_t> workers;
+	for (int rank = 0; rank < worldSize; ++rank)
+	{
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			group.abort();
+			break;
+		}
+		if (pid == 0)
+		{
+			int status = 0;
+			try
+			{
+				group.set_rank(rank);
+				pin_current_thread(core_sets[rank]);
+				at::init_num_threads();
+				at::set_num_threads(static_cast<int>(core_sets[rank].size()));
+				body(group);
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << "[worker " << rank << "] failed: " << e.what() << std::endl;
+				group.abort();
+				status = 1;
+			}
+			std::cout << std::flush;
+			_exit(status);
+		}
+		workers.push_back(pid);
+	}
+
+	int failures = worldSize - static_cast<int>(workers.size());
+	for (size_t exited = 0; exited < workers.size(); ++exited)
+	{
+		int status = 0;
+		if (waitpid(-1, &status, 0) < 0) break;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			// a crashed worker never reaches its barrier; release the others
+			group.abort();
+			++failures;
+		}
+	}
+	if (failures > 0)
+		throw std::runtime_error(std::to_string(failures) + " data-parallel worker(s) failed");
+}
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <torch/torch.h>
+#include "Attackers/IAttacker.h"
+#include "utilities.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+
+/// <summary>
+/// Worst-case robust accuracy over several attacks: a sample counts as robust only if every attack fails on it.
+/// The clean forward pass runs once per batch, samples the network already misclassifies are never attacked and
+/// every attack only sees the samples that all earlier attacks failed to break, so cheap attacks placed first
+/// spare the expensive ones most of the batch. Interface-compatible with Evaluator, so ParallelEvaluator can
+/// shard it.
+/// </summary>
+template <typename NetworkType>
+class EnsembleEvaluator
+{
+public:
+	EnsembleEvaluator(std::vector<std::shared_ptr<IAttacker<NetworkType>>> attackers, const c10::Device& device) :
+		_device(device), _attackers(attackers), _broken(attackers.size())
+	{
+		for (auto& attacker : _attackers)
+			if (attacker->getType() == AttackType::Noop) throw std::invalid_argument("an ensemble cannot contain the noop attacker");
+	}
+
+	void evaluate_single_batch(torch::nn::ModuleHolder<NetworkType> network, torch::data::Example<>& example)
+	{
+		auto data = example.data;
+		auto label = example.target;
+		auto batch_size = data.size(0);
+		network->to(data.device());
+		PROFILE_PHASE("evaluation");
+
+		torch::Tensor robust;
+		{ torch::NoGradGuard _nogradguard;
+			torch::Tensor prediction;
+			{ PROFILE_SCOPE("forward");
+				prediction = network(data);
+			}
+			PROFILE_SCOPE("accuracy");
+			robust = prediction.argmax(1).eq(label);
+			_clean_accuracy.update(robust.sum(), batch_size);
+		}
+
+		for (size_t a = 0; a < _attackers.size(); ++a)
+		{
+			// one host sync per attack: the surviving indices size the next attack's batch
+			auto remaining = robust.nonzero().squeeze(1);
+			if (remaining.size(0) == 0) break;
+			auto input = data.index_select(0, remaining);
+			auto target = label.index_select(0, remaining);
+
+			torch::Tensor adversarial_input;
+			{ PROFILE_SCOPE("attack generation");
+				PROFILE_PHASE("evaluation attack");
+				adversarial_input = (*_attackers[a])(network, input, target);
+			}
+			torch::NoGradGuard _nogradguard;
+			torch::Tensor adv_prediction;
+			{ PROFILE_SCOPE("forward");
+				adv_prediction = network(adversarial_input);
+			}
+			PROFILE_SCOPE("accuracy");
+			auto broken = adv_prediction.argmax(1).ne(target);
+			robust.index_fill_(0, remaining.masked_select(broken), false);
+			_broken[a].update(broken.sum(), remaining.size(0));
+		}
+		_robust_accuracy.update(robust.sum(), batch_size);
+	}
+
+	/// clean accuracy and worst-case robust accuracy over all attacks, in percent
+	std::pair<double, double> get_accuracies()
+	{
+		return std::make_pair(_clean_accuracy.getMean() * 100, _robust_accuracy.getMean() * 100);
+	}
+
+	/// folds the meters of another evaluator with the same attack sequence into this one
+	void merge(const EnsembleEvaluator<NetworkType>& other)
+	{
+		if (other._attackers.size() != _attackers.size()) throw std::invalid_argument("ensembles differ in their attacks");
+		_clean_accuracy.merge(other._clean_accuracy);
+		_robust_accuracy.merge(other._robust_accuracy);
+		for (size_t a = 0; a < _attackers.size(); ++a)
+			_broken[a].merge(other._broken[a]);
+	}
+
+	void reset()
+	{
+		_clean_accuracy.reset();
+		_robust_accuracy.reset();
+		for (auto& broken : _broken)
+			broken.reset();
+	}
+
+	/// one line per attack with the samples it attacked and broke, followed by the accuracies
+	void report(std::ostream& out)
+	{
+		out << std::fixed << std::setprecision(2);
+		for (size_t a = 0; a < _attackers.size(); ++a)
+			out << std::setw(2) << a + 1 << ". " << _attackers[a]->getDescription() << ": broke "
+				<< static_cast<int64_t>(_broken[a].getSum()) << " of " << _broken[a].getCount() << " attacked samples" << std::endl;
+		auto accuracies = get_accuracies();
+		out << "clean accuracy " << accuracies.first << "%, worst-case robust accuracy " << accuracies.second
+			<< "% over " << _clean_accuracy.getCount() << " samples" << std::endl;
+	}
+
+	device_meter _clean_accuracy = device_meter("clean accuracy");
+	device_meter _robust_accuracy = device_meter("worst-case robust accuracy");
+	c10::Device _device;
+	std::vector<std::shared_ptr<IAttacker<NetworkType>>> _attackers;
+
+private:
+	std::vector<device_meter> _broken;
+};
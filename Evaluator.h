@@ -2,6 +2,8 @@
 #include <torch/torch.h>
 #include "Attackers/IAttacker.h"
 #include "utilities.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
 
 template <typename NetworkType>
 class Evaluator
@@ -14,25 +16,47 @@ public:
 		auto data = example.data;
 		auto label = example.target; 
 		auto device = data.device();
+		auto batch_size = data.size(0);
 		network->to(device);
+		PROFILE_PHASE("evaluation");
 
 		{ torch::NoGradGuard _nogradguard;
+			torch::Tensor prediction;
+			{ PROFILE_SCOPE("forward");
+				prediction = network(data);
+			}
+			PROFILE_SCOPE("accuracy");
+			_clean_accuracy.update(count_torch_correct(prediction, label), batch_size);
+		}
 
-			auto prediction = network(data);
-			_clean_accuracy.update(calculate_torch_accuracy(prediction, label));
-
-			if (_attacker->getType() != AttackType::Noop)
-			{
-				auto adversarial_input = (*_attacker)(network, data, label);
-				auto adv_prediction = network(data);
-				_adversarial_accuracy.update(calculate_torch_accuracy(adv_prediction, label));
+		if (_attacker->getType() != AttackType::Noop)
+		{
+			torch::Tensor adversarial_input;
+			{ PROFILE_SCOPE("attack generation");
+				PROFILE_PHASE("evaluation attack");
+				adversarial_input = (*_attacker)(network, data, label);
+			}
+			torch::NoGradGuard _nogradguard;
+			torch::Tensor adv_prediction;
+			{ PROFILE_SCOPE("forward");
+				adv_prediction = network(adversarial_input);
 			}
+			PROFILE_SCOPE("accuracy");
+			_adversarial_accuracy.update(count_torch_correct(adv_prediction, label), batch_size);
 		}
 	}
 
+	/// copies the correct-prediction counts to the host; the only point at which evaluation waits for the device
 	std::pair<double, double> get_accuracies()
 	{
-		return std::make_pair(_clean_accuracy.getMean(), _adversarial_accuracy.getMean());
+		return std::make_pair(_clean_accuracy.getMean() * 100, _adversarial_accuracy.getMean() * 100);
+	}
+
+	/// folds the meters of another evaluator (e.g. one that ran on a different shard) into this one
+	void merge(const Evaluator<NetworkType>& other)
+	{
+		_clean_accuracy.merge(other._clean_accuracy);
+		_adversarial_accuracy.merge(other._adversarial_accuracy);
 	}
 
 	void reset()
@@ -41,8 +65,8 @@ public:
 		_adversarial_accuracy.reset();
 	}
 
-	average_meter _clean_accuracy = average_meter("clean accuracy");
-	average_meter _adversarial_accuracy = average_meter("adversarial accuracy");
+	device_meter _clean_accuracy = device_meter("clean accuracy");
+	device_meter _adversarial_accuracy = device_meter("adversarial accuracy");
 	c10::Device _device;
 	std::shared_ptr<IAttacker<NetworkType>> _attacker;
 };
\ No newline at end of file
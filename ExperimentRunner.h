@@ -1,118 +1,332 @@
 #pragma once
 #include <iostream>
 #include <chrono>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <torch/torch.h>
 #include "Trainers/ITrainer.h"
 #include "Evaluator.h"
+#include "ParallelEvaluator.h"
+#include "Profiler.h"
+#include "CheckpointWriter.h"
+#include "PrefetchingLoader.h"
+#include "Attackers/CachedAttacker.h"
 
 class IExperimentRunner
 {
 public:
 	virtual void Run() = 0;
+	virtual std::string Name() = 0;
 };
 
 struct ScopedBlockLabel
 {
 	ScopedBlockLabel(std::string msg) : _msg(msg)
 	{
-		using namespace std;
-		auto now = chrono::system_clock::to_time_t(chrono::system_clock::now());
-		cout << "Beginning " << msg << " at " << ctime(&now) << std::endl;
+		print("Beginning ");
 	}
 
 	~ScopedBlockLabel()
 	{
-		using namespace std;
-		auto now = chrono::system_clock::to_time_t(chrono::system_clock::now());
-		std::cout << "Ending " << _msg << " at " << ctime(&now) << std::endl;
+		print("Ending ");
 	}
 
 	std::string _msg;
+
+private:
+	// ctime shares a static buffer and concurrent experiments print from several threads
+	void print(const char* prefix)
+	{
+		using namespace std;
+		static mutex print_mutex;
+		lock_guard<mutex> lock(print_mutex);
+		auto now = chrono::system_clock::to_time_t(chrono::system_clock::now());
+		cout << prefix << _msg << " at " << ctime(&now) << std::endl;
+	}
 };
 
 template <typename NetworkType, typename DatasetType>
 class ExperimentRunner : public IExperimentRunner
 {
-	using DataLoader_t = std::unique_ptr<torch::data::StatelessDataLoader<DatasetType, torch::data::samplers::RandomSampler>>;
 public:
 	ExperimentRunner(
 		std::string experimentName,
 		DatasetType& dataset,
+		DatasetType& testDataset,
 		torch::nn::ModuleHolder<NetworkType> network,
 		std::shared_ptr<ITrainer> trainer,
 		int numberOfEpochs,
 		int batchSize,
-		c10::Device device) :
+		c10::Device device,
+		int evaluationWorkers = 0) :
 
 		_experimentName(experimentName),
 		_network(network),
 		_trainer(trainer),
 		_batchSize(batchSize),
 		_numberOfEpochs(numberOfEpochs),
-		_pgdAttacker(std::make_shared<PGDAttacker<NetworkType>>(
-			/*epsilon*/ 6.0 / 255.0,
-			/*sigma*/ 3.0 / 255.0,
-			/*iterations*/ 20,
-			/*device*/ device)),
+		_evaluationWorkers(evaluationWorkers),
 		_device(device),
-		_dataset(dataset)
+		_dataset(dataset),
+		_testDataset(testDataset)
 	{}
 
 	void Run() override
 	{
 		ScopedBlockLabel startExperiment("Experiment " + _experimentName);
+
+		int startEpoch = 0;
+		int64_t startBatch = 0;
+		std::unique_ptr<AsyncCheckpointWriter> checkpoints;
+		if (!_checkpointPath.empty())
+		{
+			if (AsyncCheckpointWriter::exists(_checkpointPath))
+				std::tie(startEpoch, startBatch) = restore_checkpoint();
+			// every rank restores from the same checkpoint, rank 0 alone writes it
+			if (_rank == 0) checkpoints = std::make_unique<AsyncCheckpointWriter>(_checkpointPath);
+		}
+		// data-parallel ranks must draw the same order, so they are reseeded even without checkpoints
+		bool reseeding = !_checkpointPath.empty() || _worldSize > 1;
 		
-		// Train
-		Evaluator<NetworkType> evaluator(_pgdAttacker, _device);
+		// Train; the weights change between periodic evaluations, so only the final one could ever hit the cache
+		auto evaluator = make_evaluator(/*cached*/ false);
 
-		DataLoader_t dataloader = torch::data::make_data_loader(
-			_dataset,
-			torch::data::DataLoaderOptions().batch_size(_batchSize).workers(2));
+		PrefetchingLoader<DatasetType> loader(_dataset, _batchSize, _device, _prefetchDepth, _memoryFormat);
+		loader.set_shard(_rank, _worldSize);
 
-		for (int epoch = 0; epoch < _numberOfEpochs; ++epoch)
+		for (int epoch = startEpoch; epoch < _numberOfEpochs; ++epoch)
 		{
-			ScopedBlockLabel startExperiment("epoch " + std::to_string(epoch + 1));
+			ScopedBlockLabel startExperiment("epoch " + std::to_string(epoch + 1) + " of " + _experimentName);
+
+			// Training block; waiting for the next prepared batch is profiled separately from training on it
+			if (reseeding) reseed(epoch, 0);
+			if (epoch != startEpoch || startBatch == 0) _trainer->reset_metrics();
+			int64_t position = epoch == startEpoch ? startBatch : 0;
+			// the reseeded shuffle repeats the interrupted epoch's order; the loader skips what was already trained on
+			loader.start_epoch(position);
+			if (position > 0) reseed(epoch, position);
+			loader.reset_statistics();
 
-			// Training block
-			for (torch::data::Example<> batch : *dataloader)
+			torch::data::Example<> batch;
+			while (!_trainer->should_stop() && [&]() { PROFILE_SCOPE("data loading"); return loader.next(batch); }())
+			{
 				_trainer->train_batch(batch);
+				++position;
+				if (!_checkpointPath.empty() && _checkpointEvery > 0 && position % _checkpointEvery == 0)
+				{
+					if (checkpoints) save_checkpoint(*checkpoints, epoch, position);
+					reseed(epoch, position);
+				}
+			}
+
+			print_accuracies(_trainer->get_accuracies(), _trainer->get_losses());
+			print_data_wait(loader);
+			print_workspace();
 
-			print_accuracies(_trainer->get_accuracies());
+			if (epoch % 10 && _rank == 0)
+			{
+				this->evaluate(evaluator);
+			}
+			if (checkpoints) save_checkpoint(*checkpoints, epoch + 1, 0);
 
-			if (epoch % 10)
+			if (_trainer->should_stop())
 			{
-				this->evaluate(evaluator, dataloader);
+				std::ostringstream line;
+				line << "[" << _experimentName << "] Trainer requested an early stop after epoch " << epoch + 1 << "\n";
+				std::cout << line.str() << std::flush;
+				break;
 			}
 		}
 
-		this->evaluate(evaluator, dataloader);
+		if (_rank != 0) return;
+		auto finalEvaluator = make_evaluator(/*cached*/ !_attackCache.empty());
+		this->evaluate(finalEvaluator);
+		if (checkpoints) checkpoints->flush();
+
+		// the trained weights are what yopo-serve loads
+		torch::save(_network, _experimentName + ".pt");
 	}
 
+	std::string Name() override { return _experimentName; }
+
+	/// number of batches prepared ahead of the one training; 2 double-buffers the transfer to the device
+	void SetPrefetchDepth(size_t depth) { _prefetchDepth = depth; }
+
+	/// <summary>
+	/// Keeps the final evaluation's adversarial examples in directory, keyed by the weights, the attack and the
+	/// batch. Evaluating the same weights again, e.g. rerunning a finished experiment from its last checkpoint,
+	/// replays them; ReplayOnly fails instead of attacking when an example is missing. The periodic evaluations
+	/// during training are not cached: their weights are never evaluated twice, so every entry would be a miss that
+	/// only grows the directory.
+	/// </summary>
+	void EnableAttackCache(const std::string& directory, AttackCacheMode mode = AttackCacheMode::ReadWrite)
+	{
+		_attackCache = directory;
+		_attackCacheMode = mode;
+	}
+
+	/// <summary>
+	/// Makes this runner one of worldSize data-parallel workers: it trains on its rank's share of every batch, and
+	/// the trainer's gradient synchronizer is expected to all-reduce gradients between the workers. Rank 0 alone
+	/// evaluates, writes checkpoints and saves the final weights.
+	/// </summary>
+	void SetShard(int rank, int worldSize)
+	{
+		_rank = rank;
+		_worldSize = worldSize;
+	}
+
+	/// trains and evaluates with the network and every batch in the given layout, e.g. ChannelsLast
+	void SetMemoryFormat(c10::MemoryFormat format)
+	{
+		_memoryFormat = format;
+		_network->set_memory_format(format);
+	}
+
+	/// <summary>
+	/// Checkpoints the network, the trainer's optimizer state and meters and the position in the run to path every
+	/// everyNBatches batches and after every epoch, and resumes from path if it exists when Run starts.
+	/// The random number generators are reseeded from seed at every epoch start and checkpoint, which fixes the
+	/// sampling order and makes a resumed run draw the same random numbers as an uninterrupted one.
+	/// </summary>
+	void EnableCheckpoints(const std::string& path, int everyNBatches, uint64_t seed = 0)
+	{
+		_checkpointPath = path;
+		_checkpointEvery = everyNBatches;
+		_seed = seed;
+	}
 
 private:
-	void evaluate(Evaluator<NetworkType>& evaluator, DataLoader_t& dataset)
+	/// PGD-20 with early stopping, clamped to the test dataset's input_range(), wrapped in the attack cache when cached
+	ParallelEvaluator<NetworkType, DatasetType> make_evaluator(bool cached)
+	{
+		return ParallelEvaluator<NetworkType, DatasetType>(
+			_testDataset,
+			[device = _device, cache = cached ? _attackCache : std::string(), cacheMode = _attackCacheMode,
+				range = _testDataset.input_range()]() {
+				auto pgd = std::make_shared<PGDAttacker<NetworkType>>(
+					/*epsilon*/ 6.0 / 255.0,
+					/*sigma*/ 3.0 / 255.0,
+					/*iterations*/ 20,
+					/*device*/ device,
+					/*mode*/ PGDExecutionMode::InPlace,
+					/*early_stopping*/ true);
+				pgd->set_input_range(range.first, range.second);
+				std::shared_ptr<IAttacker<NetworkType>> attacker = pgd;
+				if (!cache.empty())
+					attacker = std::make_shared<CachedAttacker<NetworkType>>(attacker, cache, cacheMode);
+				return Evaluator<NetworkType>(attacker, device);
+			},
+			// by default one evaluation worker per intra-op thread this experiment was given
+			_evaluationWorkers > 0 ? _evaluationWorkers : at::get_num_threads(),
+			_batchSize,
+			_device);
+	}
+
+	void evaluate(ParallelEvaluator<NetworkType, DatasetType>& evaluator)
 	{
+		PROFILE_SCOPE("evaluation");
 		_network->eval();
-		evaluator.reset();
-		for (torch::data::Example<> batch : *dataset)
-			evaluator.evaluate_single_batch(_network, batch);
-		print_accuracies(evaluator.get_accuracies());
+		print_accuracies(evaluator.evaluate(_network));
 		_network->train();
 	}
 
+	void reseed(int epoch, int64_t position)
+	{
+		torch::manual_seed(_seed + static_cast<uint64_t>(epoch) * 1000003 + static_cast<uint64_t>(position));
+	}
+
+	void save_checkpoint(AsyncCheckpointWriter& writer, int epoch, int64_t position)
+	{
+		PROFILE_SCOPE("checkpoint");
+		torch::serialize::OutputArchive archive, network, trainer;
+		_network->save(network);
+		_trainer->save(trainer);
+		archive.write("network", network);
+		archive.write("trainer", trainer);
+		archive.write("epoch", c10::IValue(static_cast<int64_t>(epoch)));
+		archive.write("batch", c10::IValue(position));
+		archive.write("seed", c10::IValue(static_cast<int64_t>(_seed)));
+		writer.write(archive);
+	}
+
+	/// loads the checkpoint and returns the epoch and batch to continue from
+	std::pair<int, int64_t> restore_checkpoint()
+	{
+		torch::serialize::InputArchive archive, network, trainer;
+		archive.load_from(_checkpointPath, _device);
+		archive.read("network", network);
+		archive.read("trainer", trainer);
+		_network->load(network);
+		_trainer->load(trainer);
+
+		c10::IValue epoch, position, seed;
+		archive.read("epoch", epoch);
+		archive.read("batch", position);
+		archive.read("seed", seed);
+		_seed = static_cast<uint64_t>(seed.toInt());
+
+		std::ostringstream line;
+		line << "[" << _experimentName << "] Resuming from " << _checkpointPath << " at epoch " << epoch.toInt() + 1
+			<< ", batch " << position.toInt() << "\n";
+		std::cout << line.str() << std::flush;
+		return { static_cast<int>(epoch.toInt()), position.toInt() };
+	}
+
+	void print_data_wait(const PrefetchingLoader<DatasetType>& loader)
+	{
+		std::ostringstream line;
+		line << "[" << _experimentName << "] Waited " << loader.wait_seconds() << " s for data over "
+			<< loader.batches_delivered() << " batches\n";
+		std::cout << line.str() << std::flush;
+	}
+
+	void print_workspace()
+	{
+		auto workspace = _trainer->workspace();
+		if (!workspace) return;
+		std::ostringstream line;
+		line << "[" << _experimentName << "] " << workspace->report() << "\n";
+		std::cout << line.str() << std::flush;
+	}
+
 	void print_accuracies(std::pair<double, double> accuracies)
 	{
-		std::cout << "Clean accuracy " << accuracies.first << ", Adversarial accuracy " << accuracies.second << std::endl;
+		std::ostringstream line;
+		line << "[" << _experimentName << "] Clean accuracy " << accuracies.first << ", Adversarial accuracy " << accuracies.second << "\n";
+		std::cout << line.str() << std::flush;
+	}
+
+	void print_accuracies(std::pair<double, double> accuracies, std::pair<double, double> losses)
+	{
+		std::ostringstream line;
+		line << "[" << _experimentName << "] Clean accuracy " << accuracies.first << ", Adversarial accuracy " << accuracies.second
+			<< ", Clean loss " << losses.first << ", Adversarial loss " << losses.second << "\n";
+		std::cout << line.str() << std::flush;
 	}
 
 	std::string _experimentName;
 	DatasetType _dataset;
+	DatasetType _testDataset;
 	torch::nn::ModuleHolder<NetworkType> _network;
 	std::shared_ptr<ITrainer> _trainer;
 
 	int _numberOfEpochs;
 	int _batchSize;
+	int _evaluationWorkers;
 	c10::Device _device;
-	std::shared_ptr<PGDAttacker<NetworkType>> _pgdAttacker;
+
+	c10::MemoryFormat _memoryFormat = c10::MemoryFormat::Contiguous;
+	size_t _prefetchDepth = 2;
+	int _rank = 0;
+	int _worldSize = 1;
+
+	std::string _attackCache;
+	AttackCacheMode _attackCacheMode = AttackCacheMode::ReadWrite;
+
+	std::string _checkpointPath;
+	int _checkpointEvery = 0;
+	uint64_t _seed = 0;
 
 };
\ No newline at end of file
@@ -0,0 +1,152 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <torch/torch.h>
+#include "ExperimentRunner.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// restricts the calling thread (and the threads it creates afterwards) to the given cores; no-op where unsupported
+inline void pin_current_thread(const std::vector<int>& cores)
+{
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+	for (int core : cores)
+		if (core < static_cast<int>(sizeof(DWORD_PTR) * 8)) mask |= DWORD_PTR(1) << core;
+	if (mask) SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int core : cores)
+		CPU_SET(core, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/// <summary>
+/// Runs several experiments at the same time, each on its own partition of cores. Experiments start in the order
+/// they were enqueued, as soon as enough cores are free for the next one, with their threads pinned to their cores.
+/// libtorch's intra-op thread count is process-wide (MKL's count and the default of every new thread), so all
+/// experiments share one count, given to the constructor and set once by Run before any experiment starts;
+/// experiments that need different thread counts belong in separate processes.
+/// </summary>
+class ExperimentScheduler
+{
+public:
+	ExperimentScheduler(int intraOpThreads, int totalCores = std::thread::hardware_concurrency()) :
+		_freeCores(std::max(1, totalCores), true),
+		_intraOpThreads(std::max(1, std::min(intraOpThreads, std::max(1, totalCores))))
+	{}
+
+	/// queues an experiment that will run on the given number of cores, at least the intra-op thread count
+	void Enqueue(std::shared_ptr<IExperimentRunner> experiment, int cores)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		int reserved = std::max(_intraOpThreads, std::min(cores, static_cast<int>(_freeCores.size())));
+		_queue.push_back({ experiment, reserved });
+	}
+
+	/// blocks until every queued experiment has finished
+	void Run()
+	{
+		std::vector<std::thread> running;
+		std::unique_lock<std::mutex> lock(_mutex);
+		size_t total = _queue.size();
+		if (total == 0) return;
+		at::set_num_threads(_intraOpThreads);
+		size_t started = 0;
+		while (!_queue.empty())
+		{
+			auto next = _queue.front();
+			_available.wait(lock, [&]() { return free_core_count() >= next.cores; });
+			_queue.pop_front();
+
+			auto cores = acquire_cores(next.cores);
+			report(next.experiment->Name(), "started (" + std::to_string(++started) + "/" + std::to_string(total) +
+				") on " + std::to_string(cores.size()) + " cores starting at core " + std::to_string(cores.front()));
+			running.emplace_back([this, next, cores]() { run_experiment(next, cores); });
+		}
+		lock.unlock();
+
+		for (auto& thread : running)
+			thread.join();
+	}
+
+private:
+	struct PendingExperiment
+	{
+		std::shared_ptr<IExperimentRunner> experiment;
+		int cores;
+	};
+
+	void run_experiment(PendingExperiment pending, std::vector<int> cores)
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::string outcome = "finished";
+		try
+		{
+			pin_current_thread(cores);
+			// picks up the count Run set; the pool this thread creates inherits its pinning
+			at::init_num_threads();
+			pending.experiment->Run();
+		}
+		catch (const std::exception& e)
+		{
+			outcome = std::string("failed: ") + e.what();
+		}
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (int core : cores)
+			_freeCores[core] = true;
+		report(pending.experiment->Name(), outcome + " after " + std::to_string(seconds) + "s");
+		_available.notify_all();
+	}
+
+	int free_core_count() const
+	{
+		return static_cast<int>(std::count(_freeCores.begin(), _freeCores.end(), true));
+	}
+
+	/// takes the lowest free cores so concurrent experiments end up on disjoint, mostly contiguous ranges
+	std::vector<int> acquire_cores(int count)
+	{
+		std::vector<int> cores;
+		for (int core = 0; core < static_cast<int>(_freeCores.size()) && static_cast<int>(cores.size()) < count; ++core)
+		{
+			if (!_freeCores[core]) continue;
+			_freeCores[core] = false;
+			cores.push_back(core);
+		}
+		return cores;
+	}
+
+	static void report(const std::string& name, const std::string& message)
+	{
+		std::ostringstream line;
+		line << "[scheduler] " << name << " " << message << "\n";
+		std::cout << line.str() << std::flush;
+	}
+
+	std::deque<PendingExperiment> _queue;
+	std::vector<bool> _freeCores;
+	int _intraOpThreads;
+	std::mutex _mutex;
+	std::condition_variable _available;
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <torch/torch.h>
+#include "ModuleProfiler.h"
 
 template <typename ModuleType>
 struct Hamiltonian
@@ -8,7 +9,7 @@ struct Hamiltonian
 
 	torch::Tensor operator()(torch::Tensor x, torch::Tensor p)
 	{
-		auto y = _layer(x);
+		auto y = profiled_forward(_layer, "layer one (hamiltonian)", x);
 		auto H = torch::sum(y * p);
 		return H;
 	}
@@ -16,6 +17,67 @@ struct Hamiltonian
 	torch::nn::ModuleHolder<ModuleType> _layer;
 };
 
+/// <summary>
+/// Input gradient of the Hamiltonian of a Conv2d followed by a ReLU, H = sum(relu(conv(x)) * p), computed without
+/// building an autograd graph: dH/dx is the transposed convolution of p masked by the ReLU's active set.
+/// </summary>
+struct ConvReLUHamiltonian
+{
+	ConvReLUHamiltonian(torch::nn::Conv2d conv) : _conv(conv)
+	{
+		if (!supports(conv))
+			throw std::invalid_argument("ConvReLUHamiltonian only supports zero-padded convolutions");
+	}
+
+	static bool supports(torch::nn::Conv2d conv)
+	{
+		return c10::get_if<torch::enumtype::kZeros>(&conv->options.padding_mode()) != nullptr;
+	}
+
+	torch::Tensor input_gradient(const torch::Tensor& x, const torch::Tensor& p)
+	{
+		if (!ModuleProfiler::enabled()) return compute_input_gradient(x, p);
+
+		// recorded like a module: a convolution and a transposed convolution of the same size
+		auto start = Profiler::now_ns();
+		auto gradient = compute_input_gradient(x, p);
+		const auto& weight = _conv->weight;
+		ModuleProfiler::instance().record_forward(PhaseScope::current(), "layer one (analytic gradient)", Profiler::now_ns() - start,
+			2 * 2 * p.numel() * weight.size(1) * weight.size(2) * weight.size(3), gradient.numel() * gradient.element_size());
+		return gradient;
+	}
+
+	torch::nn::Conv2d _conv;
+
+private:
+	torch::Tensor compute_input_gradient(const torch::Tensor& x, const torch::Tensor& p)
+	{
+		torch::NoGradGuard _no_grad_guard;
+		const auto& options = _conv->options;
+		auto masked_adjoint = _conv(x).gt_(0).mul_(p);
+
+		// output_padding recovers the input size when the strided convolution dropped trailing rows or columns
+		std::vector<int64_t> output_padding(2);
+		for (int d = 0; d < 2; ++d)
+		{
+			auto covered = (masked_adjoint.size(d + 2) - 1) * options.stride()[d] - 2 * options.padding()[d] +
+				options.dilation()[d] * (options.kernel_size()[d] - 1) + 1;
+			output_padding[d] = x.size(d + 2) - covered;
+		}
+
+		// transposed convolutions may not produce channels-last output; hand the gradient back in x's layout
+		return torch::conv_transpose2d(
+			masked_adjoint,
+			_conv->weight,
+			{},
+			options.stride(),
+			options.padding(),
+			output_padding,
+			options.groups(),
+			options.dilation()).contiguous(x.suggest_memory_format());
+	}
+};
+
 
 struct CrossEntropyWithWeightPenaltyImpl : torch::nn::Cloneable<CrossEntropyWithWeightPenaltyImpl>
 {
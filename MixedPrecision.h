@@ -0,0 +1,71 @@
+#pragma once
+#include <memory>
+#include <torch/torch.h>
+
+/// FP32 runs everything in float; BF16 runs forward and backward passes on a bfloat16 copy of the network
+enum ComputePrecision { FP32 = 0, BF16 };
+
+/// <summary>
+/// bfloat16 replica of a network for manual mixed precision; this libtorch has no CPU autocast. Forward and
+/// backward passes run on the replica and return fp32 logits, so losses stay in fp32. The fp32 master keeps the
+/// weights the optimizer updates: push_gradients adds the replica's gradients to the master's, pull copies the
+/// updated master weights back after a step.
+/// </summary>
+/// <typeparam name="NetworkType">must be a torch::nn::Cloneable module</typeparam>
+template <typename NetworkType>
+class LowPrecisionReplica
+{
+public:
+	LowPrecisionReplica(torch::nn::ModuleHolder<NetworkType> master, c10::ScalarType dtype = torch::kBFloat16) :
+		_master(master),
+		_replica(std::dynamic_pointer_cast<NetworkType>(master->clone())),
+		_dtype(dtype)
+	{
+		_replica->to(dtype);
+	}
+
+	torch::Tensor operator()(const torch::Tensor& x)
+	{
+		return _replica(x.to(_dtype)).to(torch::kFloat);
+	}
+
+	/// copies the master's parameters and buffers into the replica
+	void pull()
+	{
+		torch::NoGradGuard _nogradguard;
+		auto master = _master->parameters();
+		auto replica = _replica->parameters();
+		for (size_t i = 0; i < master.size(); ++i)
+			replica[i].copy_(master[i]);
+		auto master_buffers = _master->buffers();
+		auto replica_buffers = _replica->buffers();
+		for (size_t i = 0; i < master_buffers.size(); ++i)
+			replica_buffers[i].copy_(master_buffers[i]);
+	}
+
+	/// accumulates the replica's gradients into the master's in fp32 and clears them on the replica
+	void push_gradients()
+	{
+		torch::NoGradGuard _nogradguard;
+		auto master = _master->parameters();
+		auto replica = _replica->parameters();
+		for (size_t i = 0; i < master.size(); ++i)
+		{
+			auto& gradient = replica[i].mutable_grad();
+			if (!gradient.defined()) continue;
+			if (master[i].grad().defined())
+				master[i].mutable_grad().add_(gradient.to(master[i].scalar_type()));
+			else
+				master[i].mutable_grad() = gradient.to(master[i].scalar_type());
+			gradient.zero_();
+		}
+	}
+
+	torch::nn::ModuleHolder<NetworkType> replica() { return _replica; }
+	c10::ScalarType dtype() const { return _dtype; }
+
+private:
+	torch::nn::ModuleHolder<NetworkType> _master;
+	torch::nn::ModuleHolder<NetworkType> _replica;
+	c10::ScalarType _dtype;
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <vector>
+#include <torch/torch.h>
+#include "Evaluator.h"
+
+/// <summary>
+/// Evaluates a network on a held-out dataset by splitting it into contiguous shards that run as the tasks of one
+/// at::parallel_for, so they share the caller's intra-op thread pool instead of resizing it: the process-wide
+/// thread count is never changed, and the operators inside a shard run single-threaded on their pool thread.
+/// Every worker owns a clone of the network and its own evaluator, with its own attackers, made by the evaluator
+/// factory, so nothing is shared while the shards run; the per-worker meters are merged once all of them are done.
+/// </summary>
+/// <typeparam name="NetworkType">must be a torch::nn::Cloneable module</typeparam>
+/// <typeparam name="DatasetType">batch dataset returning torch::data::Example&lt;&gt; for a list of indices</typeparam>
+/// <typeparam name="EvaluatorType">Evaluator, or EnsembleEvaluator for worst-case accuracy over several attacks</typeparam>
+template <typename NetworkType, typename DatasetType, typename EvaluatorType = Evaluator<NetworkType>>
+class ParallelEvaluator
+{
+public:
+	/// makes each worker's evaluator; every call must return one with attackers of its own
+	using EvaluatorFactory = std::function<EvaluatorType()>;
+
+	ParallelEvaluator(
+		DatasetType& dataset,
+		EvaluatorFactory evaluatorFactory,
+		int numberOfWorkers,
+		int batchSize,
+		const c10::Device& device) :
+		_dataset(dataset),
+		_evaluatorFactory(evaluatorFactory),
+		_numberOfWorkers(std::max(1, numberOfWorkers)),
+		_batchSize(batchSize),
+		_device(device)
+	{
+		if (!_dataset.size().has_value())
+			throw std::invalid_argument("ParallelEvaluator requires a dataset of known size");
+	}
+
+	/// evaluates the network on every shard and returns the merged clean and adversarial accuracies
+	std::pair<double, double> evaluate(torch::nn::ModuleHolder<NetworkType> network)
+	{
+		return evaluate_all(network).get_accuracies();
+	}
+
+	/// evaluates the network on every shard and returns the evaluator holding the merged meters
+	EvaluatorType evaluate_all(torch::nn::ModuleHolder<NetworkType> network)
+	{
+		size_t size = _dataset.size().value();
+		size_t batches = (size + _batchSize - 1) / _batchSize;
+		size_t workers = std::max<size_t>(1, std::min<size_t>(_numberOfWorkers, batches));
+
+		std::vector<EvaluatorType> evaluators;
+		std::vector<torch::nn::ModuleHolder<NetworkType>> replicas;
+		evaluators.reserve(workers);
+		replicas.reserve(workers);
+		for (size_t w = 0; w < workers; ++w)
+		{
+			evaluators.push_back(_evaluatorFactory());
+			replicas.emplace_back(std::dynamic_pointer_cast<NetworkType>(network->clone(_device)));
+			replicas.back()->eval();
+		}
+
+		// a grain of one shard gives every pool thread its own shards; with more shards than threads a thread runs
+		// several in turn. The first exception of any shard is rethrown here once all of them have stopped
+		at::parallel_for(0, static_cast<int64_t>(workers), 1, [&](int64_t first, int64_t last)
+		{
+			for (size_t w = static_cast<size_t>(first); w < static_cast<size_t>(last); ++w)
+				evaluate_shard(evaluators[w], replicas[w], size * w / workers, size * (w + 1) / workers);
+		});
+
+		for (size_t w = 1; w < workers; ++w)
+			evaluators[0].merge(evaluators[w]);
+		return evaluators[0];
+	}
+
+private:
+	void evaluate_shard(
+		EvaluatorType& evaluator,
+		torch::nn::ModuleHolder<NetworkType> network,
+		size_t begin,
+		size_t end)
+	{
+		DatasetType dataset = _dataset;
+		std::vector<size_t> indices;
+		for (size_t first = begin; first < end; first += _batchSize)
+		{
+			size_t last = std::min(end, first + _batchSize);
+			indices.resize(last - first);
+			std::iota(indices.begin(), indices.end(), first);
+
+			torch::data::Example<> batch = dataset.get_batch(indices);
+			batch.data = batch.data.to(_device);
+			batch.target = batch.target.to(_device);
+			evaluator.evaluate_single_batch(network, batch);
+		}
+	}
+
+	DatasetType _dataset;
+	EvaluatorFactory _evaluatorFactory;
+	int _numberOfWorkers;
+	int _batchSize;
+	c10::Device _device;
+};
@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+#include <torch/torch.h>
+
+/// <summary>
+/// Loads training batches on a background thread while the current batch trains. The thread gathers each batch
+/// from the dataset, applies an optional transform (e.g. normalization; MappedMNIST stores normalized images),
+/// converts it to the requested memory format and, for accelerator devices, stages it in pinned memory and starts
+/// a non-blocking copy to the device. Up to queueDepth prepared batches wait in a queue.
+///
+/// The sample order is drawn with torch::randperm on the thread that calls start_epoch, so reseeding torch before
+/// each epoch reproduces the order exactly. The time next() blocks for an empty queue is the time training waited
+/// on data and is reported by wait_seconds().
+/// </summary>
+/// <typeparam name="DatasetType">batch dataset returning torch::data::Example&lt;&gt; for a list of indices</typeparam>
+template <typename DatasetType>
+class PrefetchingLoader
+{
+public:
+	using Transform = std::function<torch::Tensor(torch::Tensor)>;
+
+	PrefetchingLoader(
+		DatasetType& dataset,
+		int batchSize,
+		const c10::Device& device,
+		size_t queueDepth = 2,
+		c10::MemoryFormat format = c10::MemoryFormat::Contiguous,
+		Transform transform = nullptr) :
+		_dataset(dataset),
+		_batchSize(batchSize),
+		_device(device),
+		_queueDepth(std::max<size_t>(1, queueDepth)),
+		_format(format),
+		_transform(transform)
+	{
+		if (!_dataset.size().has_value())
+			throw std::invalid_argument("PrefetchingLoader requires a dataset of known size");
+		if (batchSize < 1) throw std::invalid_argument("batch size must be positive");
+	}
+
+	~PrefetchingLoader() { stop(); }
+
+	PrefetchingLoader(const PrefetchingLoader&) = delete;
+	PrefetchingLoader& operator=(const PrefetchingLoader&) = delete;
+
+	/// <summary>
+	/// Makes this loader deliver only its rank's share of every batch, for data-parallel workers that draw the same
+	/// order from the same seed. A final batch too small to give every rank a sample is dropped so that all ranks
+	/// see the same number of batches.
+	/// </summary>
+	void set_shard(int rank, int worldSize)
+	{
+		if (worldSize < 1 || rank < 0 || rank >= worldSize) throw std::invalid_argument("invalid shard");
+		_rank = rank;
+		_worldSize = worldSize;
+	}
+
+	/// shuffles the dataset and starts preparing the epoch's batches, beginning with batch firstBatch
+	void start_epoch(int64_t firstBatch = 0)
+	{
+		stop();
+		int64_t size = static_cast<int64_t>(_dataset.size().value());
+		auto order = torch::randperm(size, torch::kLong);
+		_order.assign(order.data_ptr<int64_t>(), order.data_ptr<int64_t>() + size);
+		_next = std::min<size_t>(_order.size(), static_cast<size_t>(std::max<int64_t>(0, firstBatch)) * _batchSize);
+
+		_queue.clear();
+		_error = nullptr;
+		_stopping = false;
+		_finished = false;
+		_thread = std::thread([this]() { run(); });
+	}
+
+	/// waits for the next prepared batch; returns false once the epoch is exhausted
+	bool next(torch::data::Example<>& batch)
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(_mutex);
+		_changed.wait(lock, [&]() { return !_queue.empty() || _finished; });
+		_waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (_queue.empty())
+		{
+			if (_error)
+			{
+				auto error = _error;
+				_error = nullptr;
+				std::rethrow_exception(error);
+			}
+			return false;
+		}
+		batch = std::move(_queue.front());
+		_queue.pop_front();
+		++_delivered;
+		_changed.notify_all();
+		return true;
+	}
+
+	/// seconds next() spent waiting for batches since the last reset_statistics
+	double wait_seconds() const { return _waited; }
+	int64_t batches_delivered() const { return _delivered; }
+
+	void reset_statistics()
+	{
+		_waited = 0;
+		_delivered = 0;
+	}
+
+private:
+	void run()
+	{
+		// the intra-op thread count is process-wide; setting it here would also throttle the training thread
+		at::init_num_threads();
+		try
+		{
+			std::vector<size_t> indices;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_changed.wait(lock, [&]() { return _stopping || _queue.size() < _queueDepth; });
+					if (_stopping || _next >= _order.size()) break;
+				}
+
+				size_t last = std::min(_order.size(), _next + _batchSize);
+				if (last - _next < static_cast<size_t>(_worldSize)) break;
+				size_t length = last - _next;
+				indices.assign(
+					_order.begin() + _next + length * _rank / _worldSize,
+					_order.begin() + _next + length * (_rank + 1) / _worldSize);
+				_next = last;
+				// sorted indices gather with a sequential sweep over the mapping; the order within a batch is irrelevant
+				std::sort(indices.begin(), indices.end());
+				auto batch = prepare(_dataset.get_batch(indices));
+
+				std::lock_guard<std::mutex> lock(_mutex);
+				_queue.push_back(std::move(batch));
+				_changed.notify_all();
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> lock(_mutex);
+		_finished = true;
+		_changed.notify_all();
+	}
+
+	/// datasets without is_view are assumed to return views
+	template <typename D>
+	static auto is_view(D& dataset, const torch::data::Example<>& batch, int) -> decltype(dataset.is_view(batch))
+	{
+		return dataset.is_view(batch);
+	}
+
+	template <typename D>
+	static bool is_view(D&, const torch::data::Example<>&, long) { return true; }
+
+	torch::data::Example<> prepare(torch::data::Example<> batch)
+	{
+		auto data = batch.data;
+		auto target = batch.target;
+		if (_transform) data = _transform(data);
+		data = data.contiguous(_format);
+		if (_device.is_cpu())
+		{
+			// views into the dataset's mapping are copied so that training never writes through them; gathered
+			// batches, and data the transform or format conversion already copied, are handed over as they are
+			bool view = is_view(_dataset, batch, 0);
+			return { view && data.is_alias_of(batch.data) ? data.clone(_format) : data, view ? target.clone() : target };
+		}
+		return {
+			data.pin_memory().to(_device, /*non_blocking*/ true),
+			target.pin_memory().to(_device, /*non_blocking*/ true) };
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_changed.notify_all();
+		if (_thread.joinable()) _thread.join();
+	}
+
+	DatasetType _dataset;
+	int _batchSize;
+	c10::Device _device;
+	size_t _queueDepth;
+	c10::MemoryFormat _format;
+	Transform _transform;
+
+	std::vector<size_t> _order;
+	size_t _next = 0;
+	int _rank = 0;
+	int _worldSize = 1;
+
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::deque<torch::data::Example<>> _queue;
+	std::exception_ptr _error;
+	bool _stopping = false;
+	bool _finished = false;
+	std::thread _thread;
+
+	double _waited = 0;
+	int64_t _delivered = 0;
+};
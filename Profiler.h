@@ -0,0 +1,182 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Scoped phase profiler. Every thread records (phase, start, duration) events with nanosecond timestamps into its
+/// own fixed-size ring buffer, so recording never takes a lock; when the buffer is full the oldest events are
+/// overwritten. The events can be exported as a Chrome trace (chrome://tracing, Perfetto) or summarized per phase.
+/// When the profiler is disabled a PROFILE_SCOPE costs one relaxed atomic load.
+/// Export while worker threads are idle, e.g. after an epoch or at the end of a run.
+/// </summary>
+class Profiler
+{
+public:
+	struct Event
+	{
+		const char* name;
+		int64_t start_ns;
+		int64_t duration_ns;
+	};
+
+	static Profiler& instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+	static int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/// starts recording; threads that have not recorded anything yet get buffers of eventsPerThread entries
+	void enable(size_t eventsPerThread = 1 << 16)
+	{
+		_eventsPerThread = std::max<size_t>(1, eventsPerThread);
+		_enabled.store(true, std::memory_order_relaxed);
+	}
+
+	void disable() { _enabled.store(false, std::memory_order_relaxed); }
+
+	/// phase names must outlive the profiler, which string literals do
+	void record(const char* name, int64_t start_ns, int64_t duration_ns)
+	{
+		auto& buffer = thread_buffer();
+		auto recorded = buffer.recorded.load(std::memory_order_relaxed);
+		buffer.events[recorded % buffer.events.size()] = { name, start_ns, duration_ns };
+		buffer.recorded.store(recorded + 1, std::memory_order_release);
+	}
+
+	void write_chrome_trace(const std::string& path)
+	{
+		std::ofstream out(path);
+		if (!out) throw std::runtime_error("unable to write " + path);
+		out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+		bool first = true;
+		for_each_event([&](int thread, const Event& event) {
+			out << (first ? "" : ",\n") << std::fixed << std::setprecision(3)
+				<< "{\"name\": \"" << event.name << "\", \"cat\": \"yopo\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread
+				<< ", \"ts\": " << (event.start_ns - _origin_ns) / 1000.0 << ", \"dur\": " << event.duration_ns / 1000.0 << "}";
+			first = false;
+		});
+		out << "\n]}\n";
+	}
+
+	/// per-phase table of call counts and times; nested phases are counted in their parent as well
+	std::string summary()
+	{
+		struct PhaseStatistics { int64_t count = 0; int64_t total_ns = 0; int64_t max_ns = 0; };
+		std::map<std::string, PhaseStatistics> phases;
+		for_each_event([&](int, const Event& event) {
+			auto& statistics = phases[event.name];
+			statistics.count += 1;
+			statistics.total_ns += event.duration_ns;
+			statistics.max_ns = std::max(statistics.max_ns, event.duration_ns);
+		});
+
+		std::vector<std::pair<std::string, PhaseStatistics>> sorted(phases.begin(), phases.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.total_ns > b.second.total_ns; });
+
+		std::ostringstream table;
+		table << std::left << std::setw(28) << "phase" << std::right << std::setw(10) << "calls" << std::setw(14) << "total ms"
+			<< std::setw(14) << "mean us" << std::setw(14) << "max us" << "\n";
+		table << std::fixed << std::setprecision(3);
+		for (auto& entry : sorted)
+		{
+			auto& statistics = entry.second;
+			table << std::left << std::setw(28) << entry.first << std::right << std::setw(10) << statistics.count
+				<< std::setw(14) << statistics.total_ns / 1e6
+				<< std::setw(14) << statistics.total_ns / 1e3 / statistics.count
+				<< std::setw(14) << statistics.max_ns / 1e3 << "\n";
+		}
+		return table.str();
+	}
+
+	/// drops every recorded event; buffers stay allocated
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto& buffer : _buffers)
+			buffer->recorded.store(0, std::memory_order_release);
+	}
+
+private:
+	struct ThreadBuffer
+	{
+		ThreadBuffer(size_t capacity, int id) : events(capacity), thread(id) {}
+		std::vector<Event> events;
+		std::atomic<uint64_t> recorded{ 0 };
+		int thread;
+	};
+
+	Profiler() : _origin_ns(now_ns()) {}
+
+	/// the registry shares ownership, so events survive the thread that recorded them
+	ThreadBuffer& thread_buffer()
+	{
+		thread_local std::shared_ptr<ThreadBuffer> buffer;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			buffer = std::make_shared<ThreadBuffer>(_eventsPerThread, static_cast<int>(_buffers.size()));
+			_buffers.push_back(buffer);
+		}
+		return *buffer;
+	}
+
+	template <typename Visitor>
+	void for_each_event(Visitor visit)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto& buffer : _buffers)
+		{
+			uint64_t recorded = buffer->recorded.load(std::memory_order_acquire);
+			uint64_t capacity = buffer->events.size();
+			for (uint64_t i = recorded > capacity ? recorded - capacity : 0; i < recorded; ++i)
+				visit(buffer->thread, buffer->events[i % capacity]);
+		}
+	}
+
+	static inline std::atomic<bool> _enabled{ false };
+	size_t _eventsPerThread = 1 << 16;
+	int64_t _origin_ns;
+	std::mutex _mutex;
+	std::vector<std::shared_ptr<ThreadBuffer>> _buffers;
+};
+
+/// records the time between its construction and destruction under the given phase name
+struct ProfileScope
+{
+	ProfileScope(const char* name) : _name(name), _start_ns(Profiler::enabled() ? Profiler::now_ns() : -1) {}
+
+	~ProfileScope()
+	{
+		if (_start_ns >= 0)
+			Profiler::instance().record(_name, _start_ns, Profiler::now_ns() - _start_ns);
+	}
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	const char* _name;
+	int64_t _start_ns;
+};
+
+#define PROFILE_SCOPE_CONCAT_INNER(a, b) a##b
+#define PROFILE_SCOPE_CONCAT(a, b) PROFILE_SCOPE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_SCOPE_CONCAT(_profile_scope_, __LINE__)(name)
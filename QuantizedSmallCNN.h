@@ -0,0 +1,240 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <torch/torch.h>
+#include "SmallCNN.h"
+
+/// <summary>
+/// Post-training int8 quantization of a SmallCNN for CPU inference. Conv and linear weights are quantized per
+/// tensor once; every conv runs as im2col followed by the same int8 GEMM as the linears. Calibration batches fix
+/// the range of each layer's input, and inputs are clamped to that range before they are quantized.
+/// With FBGEMM the GEMMs use packed int8 weights and FBGEMM quantizes the clamped activations per batch; without
+/// it the same quantization is simulated in float (fake_quantize), which reproduces the accuracy but not the speed.
+///
+/// Gradients use a straight-through estimator: when autograd is on, forward returns the int8 logits with the
+/// gradient of a float copy of the network, so gradient attacks such as PGD can run against the quantized model
+/// through the usual Evaluator. Under a NoGradGuard only the int8 path runs.
+/// </summary>
+struct QuantizedSmallCNNImpl : torch::nn::Module
+{
+	QuantizedSmallCNNImpl(SmallCNN network, const std::vector<torch::Tensor>& calibrationBatches) :
+		_reference(register_module("_reference", SmallCNN(std::dynamic_pointer_cast<SmallCNNImpl>(network->clone(c10::kCPU))))),
+		_fbgemm(at::fbgemm_is_cpu_supported())
+	{
+		if (calibrationBatches.empty())
+			throw std::invalid_argument("quantization needs at least one calibration batch");
+		_reference->eval();
+
+		torch::NoGradGuard _nogradguard;
+		for (auto stage : { _reference->layer_one(), _reference->feature_extractor(), _reference->classifier() })
+			for (auto& layer : stage->children())
+				add_layer(*layer);
+
+		for (auto& batch : calibrationBatches)
+			run_stages(batch.to(c10::kCPU), /*calibrate*/ true);
+		for (auto& stage : _stages)
+			if (stage.kind == StageKind::Convolution || stage.kind == StageKind::Linear)
+				quantize(stage);
+	}
+
+	torch::Tensor forward(torch::Tensor x)
+	{
+		if (!x.device().is_cpu())
+			throw std::invalid_argument("the int8 model only runs on the CPU");
+
+		torch::Tensor quantized;
+		{ torch::NoGradGuard _nogradguard;
+			quantized = run_stages(x.detach(), /*calibrate*/ false);
+		}
+		if (!torch::GradMode::is_enabled())
+			return quantized;
+
+		auto reference = _reference(x);
+		return reference + (quantized - reference).detach();
+	}
+
+	/// true when the GEMMs run on FBGEMM's int8 kernels rather than the simulated fallback
+	bool uses_fbgemm() const { return _fbgemm; }
+
+	/// bytes held by the quantized weights and float biases, against the float model's parameter bytes
+	size_t int8_weight_bytes() const
+	{
+		size_t bytes = 0;
+		for (auto& stage : _stages)
+			if (stage.weight.defined())
+				bytes += stage.weight.numel() + stage.bias.numel() * sizeof(float);
+		return bytes;
+	}
+
+	size_t float_weight_bytes() const
+	{
+		size_t bytes = 0;
+		for (auto& parameter : _reference->parameters())
+			bytes += parameter.numel() * parameter.element_size();
+		return bytes;
+	}
+
+private:
+	enum class StageKind { Convolution, MaxPool, Flatten, Linear, ReLU };
+
+	struct Stage
+	{
+		StageKind kind;
+		bool relu = false;
+		std::vector<int64_t> kernel_size, stride, padding, dilation;
+		bool ceil_mode = false;
+
+		// GEMM stages: float weight as [out, in], replaced by its int8 form once calibrated
+		torch::Tensor weight, bias;
+		torch::Tensor packed, column_offsets;
+		double weight_scale = 1;
+		int64_t weight_zero_point = 0;
+		float input_min = std::numeric_limits<float>::max();
+		float input_max = std::numeric_limits<float>::lowest();
+	};
+
+	void add_layer(torch::nn::Module& layer)
+	{
+		if (auto conv = layer.as<torch::nn::Conv2dImpl>())
+		{
+			if (conv->options.groups() != 1 || c10::get_if<torch::enumtype::kZeros>(&conv->options.padding_mode()) == nullptr)
+				throw std::invalid_argument("only ungrouped, zero-padded convolutions can be quantized");
+			Stage stage;
+			stage.kind = StageKind::Convolution;
+			stage.kernel_size = conv->options.kernel_size().vec();
+			stage.stride = conv->options.stride().vec();
+			stage.padding = conv->options.padding().vec();
+			stage.dilation = conv->options.dilation().vec();
+			stage.weight = conv->weight.detach().reshape({ conv->weight.size(0), -1 }).contiguous();
+			stage.bias = conv->bias.defined() ? conv->bias.detach().clone() : torch::zeros({ conv->weight.size(0) });
+			_stages.push_back(stage);
+		}
+		else if (auto pool = layer.as<torch::nn::MaxPool2dImpl>())
+		{
+			Stage stage;
+			stage.kind = StageKind::MaxPool;
+			stage.kernel_size = pool->options.kernel_size().vec();
+			stage.stride = pool->options.stride().vec();
+			stage.padding = pool->options.padding().vec();
+			stage.dilation = pool->options.dilation().vec();
+			stage.ceil_mode = pool->options.ceil_mode();
+			_stages.push_back(stage);
+		}
+		else if (auto linear = layer.as<torch::nn::LinearImpl>())
+		{
+			if (_stages.empty() || _stages.back().kind != StageKind::Linear)
+				_stages.push_back({ StageKind::Flatten });
+			Stage stage;
+			stage.kind = StageKind::Linear;
+			stage.weight = linear->weight.detach().contiguous();
+			stage.bias = linear->options.bias() ? linear->bias.detach().clone() : torch::zeros({ linear->weight.size(0) });
+			_stages.push_back(stage);
+		}
+		else if (layer.as<torch::nn::ReLUImpl>())
+		{
+			if (_stages.empty() || _stages.back().relu ||
+				(_stages.back().kind != StageKind::Convolution && _stages.back().kind != StageKind::Linear))
+				_stages.push_back({ StageKind::ReLU });
+			_stages.back().relu = true;
+		}
+		else if (!layer.as<torch::nn::DropoutImpl>())
+		{
+			throw std::invalid_argument("unable to quantize layer " + layer.name());
+		}
+	}
+
+	/// quantizes a calibrated stage's weight; the input range always includes 0 so that zero padding stays exact
+	void quantize(Stage& stage)
+	{
+		if (stage.input_min > stage.input_max)
+			throw std::runtime_error("a layer was not reached during calibration");
+		stage.input_min = std::min(stage.input_min, 0.0f);
+		stage.input_max = std::max(stage.input_max, 0.0f);
+
+		if (_fbgemm)
+		{
+			auto quantized = at::fbgemm_linear_quantize_weight(stage.weight);
+			stage.weight = std::get<0>(quantized);
+			stage.column_offsets = std::get<1>(quantized);
+			stage.weight_scale = std::get<2>(quantized);
+			stage.weight_zero_point = std::get<3>(quantized);
+			stage.packed = at::fbgemm_pack_quantized_matrix(stage.weight);
+		}
+		else
+		{
+			stage.weight_scale = std::max(stage.weight.abs().max().item<double>() / 127.0, 1e-12);
+			stage.weight = torch::fake_quantize_per_tensor_affine(stage.weight, stage.weight_scale, 0, -128, 127);
+		}
+	}
+
+	torch::Tensor gemm(const Stage& stage, const torch::Tensor& input)
+	{
+		auto x = input.clamp(stage.input_min, stage.input_max);
+		if (_fbgemm)
+		{
+			return at::fbgemm_linear_int8_weight_fp32_activation(
+				x, stage.weight, stage.packed, stage.column_offsets, stage.weight_scale, stage.weight_zero_point, stage.bias);
+		}
+
+		double scale = std::max<double>((stage.input_max - stage.input_min) / 255.0, 1e-12);
+		int64_t zero_point = static_cast<int64_t>(std::lround(-stage.input_min / scale));
+		x = torch::fake_quantize_per_tensor_affine(x, scale, zero_point, 0, 255);
+		return torch::addmm(stage.bias, x, stage.weight.t());
+	}
+
+	/// conv as im2col + GEMM: [B, C, H, W] -> [B * L, C * kh * kw] -> [B * L, O] -> [B, O, Hout, Wout]
+	torch::Tensor convolution(const Stage& stage, const torch::Tensor& x, bool calibrate)
+	{
+		std::vector<int64_t> output_size(2);
+		for (int d = 0; d < 2; ++d)
+			output_size[d] = (x.size(d + 2) + 2 * stage.padding[d] - stage.dilation[d] * (stage.kernel_size[d] - 1) - 1) / stage.stride[d] + 1;
+
+		auto columns = torch::nn::functional::unfold(x, torch::nn::functional::UnfoldFuncOptions(stage.kernel_size)
+			.dilation(stage.dilation).padding(stage.padding).stride(stage.stride));
+		auto rows = columns.transpose(1, 2).reshape({ -1, columns.size(1) });
+		auto y = calibrate ? torch::addmm(stage.bias, rows, stage.weight.t()) : gemm(stage, rows);
+		return y.view({ x.size(0), output_size[0] * output_size[1], -1 }).permute({ 0, 2, 1 })
+			.reshape({ x.size(0), -1, output_size[0], output_size[1] });
+	}
+
+	/// runs the stages in float while calibrating (recording each GEMM's input range) and in int8 afterwards
+	torch::Tensor run_stages(torch::Tensor x, bool calibrate)
+	{
+		for (auto& stage : _stages)
+		{
+			if (calibrate && (stage.kind == StageKind::Convolution || stage.kind == StageKind::Linear))
+			{
+				stage.input_min = std::min(stage.input_min, x.min().item<float>());
+				stage.input_max = std::max(stage.input_max, x.max().item<float>());
+			}
+
+			switch (stage.kind)
+			{
+			case StageKind::Convolution:
+				x = convolution(stage, x, calibrate);
+				break;
+			case StageKind::MaxPool:
+				x = torch::max_pool2d(x, stage.kernel_size, stage.stride, stage.padding, stage.dilation, stage.ceil_mode);
+				break;
+			case StageKind::Flatten:
+				x = x.reshape({ x.size(0), -1 });
+				break;
+			case StageKind::Linear:
+				x = calibrate ? torch::addmm(stage.bias, x, stage.weight.t()) : gemm(stage, x);
+				break;
+			case StageKind::ReLU:
+				break;
+			}
+			if (stage.relu) x.relu_();
+		}
+		return x;
+	}
+
+	SmallCNN _reference;
+	bool _fbgemm;
+	std::vector<Stage> _stages;
+};
+
+TORCH_MODULE(QuantizedSmallCNN);
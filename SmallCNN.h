@@ -1,5 +1,6 @@
 #pragma once
 #include <torch/torch.h>
+#include "ModuleProfiler.h"
 
 namespace nn = torch::nn;
 
@@ -12,10 +13,16 @@ struct StackSequentialImpl : torch::nn::SequentialImpl {
 };
 TORCH_MODULE(StackSequential);
 
-struct SmallCNNImpl : nn::Module
+struct SmallCNNImpl : nn::Cloneable<SmallCNNImpl>
 {
 public:
-	SmallCNNImpl(double drop_rate = 0.5, size_t numlabels = 10) : _numlabels(numlabels)
+	SmallCNNImpl(double drop_rate = 0.5, size_t numlabels = 10) : _drop_rate(drop_rate), _numlabels(numlabels)
+	{
+		reset();
+	}
+
+	/// builds and registers the layers; also used by clone() to give replicas their own parameters
+	void reset() override
 	{
 		_conv1 = create_conv2d(this->_numchannels, 32, 3);
 
@@ -38,7 +45,7 @@ public:
 		_classifier = nn::Sequential(
 			nn::Linear(64 * 4 * 4, 200),
 			nn::ReLU(),
-			nn::Dropout(drop_rate),
+			nn::Dropout(_drop_rate),
 			nn::Linear(200, 200),
 			nn::ReLU(),
 			lin3);
@@ -51,34 +58,64 @@ public:
 		auto lin3params = lin3->named_parameters();
 		nn::init::constant_(lin3params["weight"], 0);
 		nn::init::constant_(lin3params["bias"], 0);
+
+		// clones keep the layout of the network they were cloned from
+		if (_memory_format != c10::MemoryFormat::Contiguous)
+			set_memory_format(_memory_format);
 	}
 
+	/// <summary>
+	/// Stores the conv weights in the given layout, e.g. ChannelsLast, and converts inputs to it on entry, so
+	/// activations and input gradients stay in that layout through every conv instead of being reordered per op.
+	/// Parameters keep their identity, so optimizers created before the call stay valid.
+	/// </summary>
+	void set_memory_format(c10::MemoryFormat format)
+	{
+		torch::NoGradGuard _nogradguard;
+		_memory_format = format;
+		for (auto& parameter : parameters())
+			if (parameter.dim() == 4) parameter.set_data(parameter.contiguous(format));
+	}
+
+	c10::MemoryFormat memory_format() const { return _memory_format; }
+
 	torch::Tensor forward(torch::Tensor x)
+	{
+		return forward_from_layer_one(forward_layer_one(x));
+	}
+
+	/// the input up to layer one's output; YOPOTrainer splits the forward pass here (see LayerOneTraits)
+	torch::Tensor forward_layer_one(torch::Tensor x)
 	{
 		if (x.dim() != 4 || x.size(1) != 1 || x.size(2) != 28 || x.size(3) != 28)
 			throw std::invalid_argument("Incorrectly sized input tensor. Should have dimensions BatchSize X Channel (1) X Height (28) X Width (28)");
-		auto y = _l1->forward(x);
-		_l1out = y; _l1out.requires_grad_(); _l1out.retain_grad();
-		auto features = this->_feature_extractor->forward(y);
-		auto logits = this->_classifier->forward(features.view({ -1, 64 * 4 * 4 }));
-		return logits;
+		return profiled_forward(_l1, "_l1", x.contiguous(_memory_format));
 	}
-	
-	torch::Tensor layer_one_output() { return _l1out;  }
+
+	torch::Tensor forward_from_layer_one(torch::Tensor y)
+	{
+		auto features = profiled_forward(_feature_extractor, "_feature_extractor", y);
+		// reshape, not view: flattening a channels-last tensor needs a copy
+		return profiled_forward(_classifier, "_classifier", features.reshape({ -1, 64 * 4 * 4 }));
+	}
+
 	nn::Sequential layer_one() { return _l1;  }
 	nn::Conv2d conv1() { return _conv1; }
+	nn::Sequential feature_extractor() { return _feature_extractor; }
+	nn::Sequential classifier() { return _classifier; }
 
 
 private:
 	// data
+	double _drop_rate = 0.5;
 	size_t _numchannels = 1;
 	size_t _numlabels = 10;
+	c10::MemoryFormat _memory_format = c10::MemoryFormat::Contiguous;
 
 
 	// layers
 	nn::Conv2d _conv1{ nullptr };
 	nn::Sequential _l1{ nullptr };
-	torch::Tensor _l1out;
 	nn::Sequential _feature_extractor{ nullptr };
 	nn::Sequential _classifier{ nullptr };
 
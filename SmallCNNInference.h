@@ -0,0 +1,144 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <torch/torch.h>
+#include "SmallCNN.h"
+
+/// Dense runs the frozen graph with regular ATen kernels on any device; MKLDNN keeps activations in oneDNN's
+/// blocked layout and uses weights reordered for it ahead of time (CPU builds with MKLDNN only)
+enum InferenceBackend { Dense = 0, MKLDNN };
+
+/// <summary>
+/// Inference-only snapshot of a SmallCNN. The layers are flattened into a fixed list of stages with detached
+/// copies of the weights, so a forward pass skips the module tree, the shape checks, dropout and the layer-one
+/// gradient hook. Every ReLU runs in place on the output of the conv or linear before it, the linear weights are
+/// stored pre-transposed for addmm and, on the MKLDNN backend, the conv weights are pre-packed.
+/// Later changes to the source network's parameters are not seen by the snapshot.
+/// </summary>
+class SmallCNNInference
+{
+public:
+	SmallCNNInference(SmallCNN network, InferenceBackend backend = InferenceBackend::Dense) : _backend(backend)
+	{
+		torch::NoGradGuard _nogradguard;
+		if (_backend == InferenceBackend::MKLDNN && (!at::hasMKLDNN() || !network->parameters().front().device().is_cpu()))
+			throw std::invalid_argument("the MKLDNN inference backend needs a CPU network and a build with MKLDNN");
+
+		for (auto stage : { network->layer_one(), network->feature_extractor(), network->classifier() })
+			for (auto& layer : stage->children())
+				add_layer(*layer);
+	}
+
+	torch::Tensor forward(torch::Tensor x) const
+	{
+		torch::NoGradGuard _nogradguard;
+		bool blocked = false;
+		for (auto& stage : _stages)
+		{
+			switch (stage.kind)
+			{
+			case StageKind::Convolution:
+				if (_backend == InferenceBackend::MKLDNN)
+				{
+					if (!blocked) { x = x.to_mkldnn(); blocked = true; }
+					x = at::mkldnn_convolution(x, stage.weight, stage.bias, stage.padding, stage.stride, stage.dilation, stage.groups);
+				}
+				else
+				{
+					x = torch::conv2d(x, stage.weight, stage.bias, stage.stride, stage.padding, stage.dilation, stage.groups);
+				}
+				break;
+			case StageKind::MaxPool:
+				x = torch::max_pool2d(x, stage.kernel_size, stage.stride, stage.padding, stage.dilation, stage.ceil_mode);
+				break;
+			case StageKind::Flatten:
+				if (blocked) { x = x.to_dense(); blocked = false; }
+				x = x.reshape({ x.size(0), -1 });
+				break;
+			case StageKind::Linear:
+				x = torch::addmm(stage.bias, x, stage.weight);
+				break;
+			case StageKind::ReLU:
+				break;
+			}
+			if (stage.relu) x.relu_();
+		}
+		return blocked ? x.to_dense() : x;
+	}
+
+	torch::Tensor operator()(torch::Tensor x) const { return forward(x); }
+
+	InferenceBackend backend() const { return _backend; }
+
+private:
+	enum class StageKind { Convolution, MaxPool, Flatten, Linear, ReLU };
+
+	struct Stage
+	{
+		StageKind kind;
+		bool relu = false;
+		torch::Tensor weight, bias;
+		std::vector<int64_t> kernel_size, stride, padding, dilation;
+		int64_t groups = 1;
+		bool ceil_mode = false;
+	};
+
+	void add_layer(torch::nn::Module& layer)
+	{
+		if (auto conv = layer.as<torch::nn::Conv2dImpl>())
+		{
+			if (c10::get_if<torch::enumtype::kZeros>(&conv->options.padding_mode()) == nullptr)
+				throw std::invalid_argument("only zero-padded convolutions can be frozen");
+			Stage stage;
+			stage.kind = StageKind::Convolution;
+			stage.stride = conv->options.stride().vec();
+			stage.padding = conv->options.padding().vec();
+			stage.dilation = conv->options.dilation().vec();
+			stage.groups = conv->options.groups();
+			stage.weight = conv->weight.detach().clone();
+			stage.bias = conv->bias.defined() ? conv->bias.detach().clone() : torch::Tensor();
+			if (_backend == InferenceBackend::MKLDNN)
+			{
+				stage.weight = at::mkldnn_reorder_conv2d_weight(stage.weight.to_mkldnn(), stage.padding, stage.stride, stage.dilation, stage.groups);
+				if (stage.bias.defined()) stage.bias = stage.bias.to_mkldnn();
+			}
+			_stages.push_back(stage);
+		}
+		else if (auto pool = layer.as<torch::nn::MaxPool2dImpl>())
+		{
+			Stage stage;
+			stage.kind = StageKind::MaxPool;
+			stage.kernel_size = pool->options.kernel_size().vec();
+			stage.stride = pool->options.stride().vec();
+			stage.padding = pool->options.padding().vec();
+			stage.dilation = pool->options.dilation().vec();
+			stage.ceil_mode = pool->options.ceil_mode();
+			_stages.push_back(stage);
+		}
+		else if (auto linear = layer.as<torch::nn::LinearImpl>())
+		{
+			if (_stages.empty() || _stages.back().kind != StageKind::Linear)
+				_stages.push_back({ StageKind::Flatten });
+			Stage stage;
+			stage.kind = StageKind::Linear;
+			stage.weight = linear->weight.detach().t().contiguous();
+			stage.bias = linear->options.bias() ? linear->bias.detach().clone() : torch::zeros({ linear->weight.size(0) }, linear->weight.options());
+			_stages.push_back(stage);
+		}
+		else if (layer.as<torch::nn::ReLUImpl>())
+		{
+			// fold into the preceding conv or linear; a ReLU after anything else gets a stage of its own
+			if (_stages.empty() || _stages.back().relu ||
+				(_stages.back().kind != StageKind::Convolution && _stages.back().kind != StageKind::Linear))
+				_stages.push_back({ StageKind::ReLU });
+			_stages.back().relu = true;
+		}
+		else if (!layer.as<torch::nn::DropoutImpl>())
+		{
+			throw std::invalid_argument("unable to freeze layer " + layer.name());
+		}
+	}
+
+	InferenceBackend _backend;
+	std::vector<Stage> _stages;
+};
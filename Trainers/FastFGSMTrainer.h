@@ -0,0 +1,255 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <torch/torch.h>
+#include "ITrainer.h"
+#include "Attackers/IAttacker.h"
+#include "utilities.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+
+/// <summary>
+/// Fast adversarial training with a single FGSM step from a uniform random start (Wong et al., 2020): the
+/// perturbation starts uniformly in the epsilon ball, takes one signed step of size alpha (1.25 epsilon by default)
+/// and is projected back with clip_eta, so one batch costs two forward/backward passes instead of PGD's K + 1. Clean
+/// accuracy and loss need a third, forward-only pass and are therefore measured on every tenth batch only (see
+/// set_clean_metrics_interval).
+///
+/// Single-step training can overfit catastrophically: robust accuracy against multi-step attacks collapses within a
+/// few batches while FGSM accuracy keeps rising. With an overfitting check configured, the trainer measures PGD
+/// accuracy on a held-out batch at a fixed interval, remembers the weights with the best value and, once accuracy
+/// falls too far below it, restores those weights and asks the runner to stop through should_stop().
+/// </summary>
+template <typename NetworkType, typename LossModuleType>
+class FastFGSMTrainer : public ITrainer
+{
+public:
+	FastFGSMTrainer(
+		torch::nn::ModuleHolder<NetworkType> network,
+		std::shared_ptr<torch::optim::Optimizer> optimizer,
+		torch::nn::ModuleHolder<LossModuleType> loss,
+		double epsilon,
+		c10::Device device = c10::kCPU,
+		double alpha = 0) :
+		_network(network),
+		_optimizer(optimizer),
+		_loss(loss),
+		_epsilon(epsilon),
+		_alpha(alpha > 0 ? alpha : 1.25 * epsilon),
+		_device(device)
+	{}
+
+	/// <summary>
+	/// Checks PGD accuracy on heldOut every everyNBatches batches and stops training once it drops more than
+	/// tolerance percentage points below the best value seen so far. heldOut must be excluded from training and
+	/// from the final test evaluation, e.g. a MappedMNIST::subset of the training split that is not trained on;
+	/// the attacker should clamp to the data's input range.
+	/// </summary>
+	void set_overfitting_check(
+		torch::data::Example<> heldOut,
+		std::shared_ptr<IAttacker<NetworkType>> attacker,
+		int everyNBatches = 100,
+		double tolerance = 20)
+	{
+		_held_out = torch::data::Example<>(heldOut.data.to(_device), heldOut.target.to(_device));
+		_check_attacker = attacker;
+		_check_every = everyNBatches;
+		_tolerance = tolerance;
+	}
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper)
+	{
+		if (lower >= upper) throw std::invalid_argument("the input range is empty");
+		_lower = lower;
+		_upper = upper;
+	}
+
+	/// measures clean accuracy and loss every everyNBatches batches; 1 measures every batch at one more forward pass each
+	void set_clean_metrics_interval(int everyNBatches)
+	{
+		if (everyNBatches < 1) throw std::invalid_argument("the clean metrics interval must be positive");
+		_clean_every = everyNBatches;
+	}
+
+	void train_batch(torch::data::Example<> example)
+	{
+		if (_stopped) return;
+		auto data = example.data.to(_device);
+		auto labels = example.target.to(_device);
+		PROFILE_PHASE("weight update");
+
+		torch::Tensor eta;
+		{ PROFILE_SCOPE("attack generation");
+			PROFILE_PHASE("attack");
+			torch::Tensor input;
+			{ torch::NoGradGuard _nogradguard;
+				eta = torch::empty_like(data).uniform_(-_epsilon, _epsilon);
+				input = torch::clamp(data + eta, _lower, _upper).requires_grad_();
+			}
+			_network->train();
+			auto loss = _loss(_network(input), labels);
+			auto gradient = torch::autograd::grad({ loss }, { input }, {}, false)[0];
+
+			torch::NoGradGuard _nogradguard;
+			eta = clip_eta(input.detach() - data + gradient.sign() * _alpha, 'I', _epsilon);
+			eta = torch::clamp(data + eta, _lower, _upper).sub_(data);
+		}
+
+		torch::Tensor prediction, loss;
+		{ PROFILE_SCOPE("forward");
+			prediction = _network(data + eta);
+			loss = _loss(prediction, labels);
+		}
+		{ PROFILE_SCOPE("backward");
+			_optimizer->zero_grad();
+			loss.backward();
+		}
+		{ PROFILE_SCOPE("optimizer step");
+			synchronize_gradients();
+			_optimizer->step();
+		}
+		{ PROFILE_SCOPE("accuracy");
+			torch::NoGradGuard _nogradguard;
+			_adversarial_accuracy.update(count_torch_correct(prediction, labels), data.size(0));
+			_adversarial_loss.update(loss * data.size(0), data.size(0));
+			if (_batches % _clean_every == 0)
+			{
+				auto clean_prediction = _network(data);
+				_clean_accuracy.update(count_torch_correct(clean_prediction, labels), data.size(0));
+				_clean_loss.update(_loss(clean_prediction, labels) * data.size(0), data.size(0));
+			}
+		}
+
+		++_batches;
+		if (_check_attacker && _batches % _check_every == 0)
+			check_overfitting();
+	}
+
+	std::pair<double, double> get_accuracies()
+	{
+		return std::make_pair(_clean_accuracy.getMean() * 100, _adversarial_accuracy.getMean() * 100);
+	}
+
+	std::pair<double, double> get_losses()
+	{
+		return std::make_pair(_clean_loss.getMean(), _adversarial_loss.getMean());
+	}
+
+	void reset_metrics()
+	{
+		_clean_accuracy.reset();
+		_adversarial_accuracy.reset();
+		_clean_loss.reset();
+		_adversarial_loss.reset();
+	}
+
+	bool should_stop() { return _stopped; }
+
+	/// PGD accuracy on the held-out batch at the last check, or -1 before the first one
+	double held_out_robust_accuracy() const { return _last_robust_accuracy; }
+
+	void save(torch::serialize::OutputArchive& archive)
+	{
+		torch::serialize::OutputArchive optimizer;
+		_optimizer->save(optimizer);
+		archive.write("optimizer", optimizer);
+		archive.write("batches", c10::IValue(_batches));
+		archive.write("best_robust_accuracy", c10::IValue(_best_robust_accuracy));
+		archive.write("stopped", c10::IValue(_stopped));
+		torch::serialize::OutputArchive best_parameters;
+		for (size_t i = 0; i < _best_parameters.size(); ++i)
+			best_parameters.write(std::to_string(i), _best_parameters[i]);
+		archive.write("best_parameters", best_parameters);
+		_clean_accuracy.save(archive, "clean_accuracy");
+		_adversarial_accuracy.save(archive, "adversarial_accuracy");
+		_clean_loss.save(archive, "clean_loss");
+		_adversarial_loss.save(archive, "adversarial_loss");
+	}
+
+	void load(torch::serialize::InputArchive& archive)
+	{
+		torch::serialize::InputArchive optimizer;
+		archive.read("optimizer", optimizer);
+		_optimizer->load(optimizer);
+		c10::IValue batches, best, stopped;
+		archive.read("batches", batches);
+		archive.read("best_robust_accuracy", best);
+		archive.read("stopped", stopped);
+		_batches = batches.toInt();
+		_best_robust_accuracy = best.toDouble();
+		_stopped = stopped.toBool();
+		// the best weights are restored as tensors of this trainer's device, one per network parameter
+		torch::serialize::InputArchive best_parameters;
+		archive.read("best_parameters", best_parameters);
+		_best_parameters.clear();
+		torch::Tensor parameter;
+		for (size_t i = 0; best_parameters.try_read(std::to_string(i), parameter); ++i)
+			_best_parameters.push_back(parameter.to(_device));
+		_clean_accuracy.load(archive, "clean_accuracy");
+		_adversarial_accuracy.load(archive, "adversarial_accuracy");
+		_clean_loss.load(archive, "clean_loss");
+		_adversarial_loss.load(archive, "adversarial_loss");
+	}
+
+private:
+	void check_overfitting()
+	{
+		PROFILE_SCOPE("overfitting check");
+		PROFILE_PHASE("overfitting check");
+		_network->eval();
+		auto adversarial_input = (*_check_attacker)(_network, _held_out.data, _held_out.target);
+		{ torch::NoGradGuard _nogradguard;
+			_last_robust_accuracy = calculate_torch_accuracy(_network(adversarial_input), _held_out.target);
+		}
+		_network->train();
+
+		if (_last_robust_accuracy > _best_robust_accuracy)
+		{
+			_best_robust_accuracy = _last_robust_accuracy;
+			torch::NoGradGuard _nogradguard;
+			_best_parameters.clear();
+			for (auto& parameter : _network->parameters())
+				_best_parameters.push_back(parameter.detach().clone());
+		}
+		else if (_last_robust_accuracy < _best_robust_accuracy - _tolerance)
+		{
+			std::cout << "Catastrophic overfitting: held-out PGD accuracy fell from " << _best_robust_accuracy << " to "
+				<< _last_robust_accuracy << "; restoring the best weights and stopping" << std::endl;
+			torch::NoGradGuard _nogradguard;
+			auto parameters = _network->parameters();
+			for (size_t i = 0; i < _best_parameters.size() && i < parameters.size(); ++i)
+				parameters[i].copy_(_best_parameters[i]);
+			_stopped = true;
+		}
+	}
+
+	torch::nn::ModuleHolder<NetworkType> _network;
+	std::shared_ptr<torch::optim::Optimizer> _optimizer;
+	torch::nn::ModuleHolder<LossModuleType> _loss;
+	double _epsilon;
+	double _alpha;
+	c10::Device _device;
+	double _lower = 0;
+	double _upper = 1;
+
+	// catastrophic overfitting check
+	torch::data::Example<> _held_out;
+	std::shared_ptr<IAttacker<NetworkType>> _check_attacker;
+	int _check_every = 100;
+	double _tolerance = 20;
+	int64_t _batches = 0;
+	int _clean_every = 10;
+	double _best_robust_accuracy = -1;
+	double _last_robust_accuracy = -1;
+	std::vector<torch::Tensor> _best_parameters;
+	bool _stopped = false;
+
+	device_meter _clean_accuracy = device_meter("clean accuracy");
+	device_meter _adversarial_accuracy = device_meter("adversarial accuracy");
+	device_meter _clean_loss = device_meter("clean loss");
+	device_meter _adversarial_loss = device_meter("adversarial loss");
+};
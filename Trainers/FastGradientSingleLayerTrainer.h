@@ -1,9 +1,13 @@
 #pragma once
 #include <memory>
+#include <type_traits>
 #include <torch/torch.h>
 #include "ITrainer.h"
 #include "utilities.h"
 #include "Loss.h"
+#include "Profiler.h"
+#include "WorkspacePool.h"
+#include "ModuleProfiler.h"
 
 template <typename LayerType>
 class FastGradientSingleLayerTrainer
@@ -15,6 +19,7 @@ public:
 		double epsilon,
 		int N2) :
 		_hamiltonian(layerone),
+		_analytic_hamiltonian(make_analytic_hamiltonian(layerone)),
 		_optimizer(std::make_shared<torch::optim::SGD>(
 			layerone->parameters(),
 			torch::optim::SGDOptions(0.005).momentum(0.9).weight_decay(0.0005))),
@@ -27,34 +32,123 @@ public:
 	{
 		if (!data.is_same_size(eta)) throw std::invalid_argument("data and eta must be of the same size");
 		p.detach_();
+		{ PROFILE_SCOPE("yopo inner loop");
+			PROFILE_PHASE("yopo inner N2");
+			if (_analytic_hamiltonian)
+				eta = analytic_inner_loop(data, p, eta);
+			else
+				eta = autograd_inner_loop(data, p, eta);
+		}
+
+		PROFILE_SCOPE("layer one backward");
+		PROFILE_PHASE("yopo layer one update");
+		torch::Tensor yopo_input = _workspace.acquire_like(data);
+		{ torch::NoGradGuard _no_grad_guard;
+			torch::add_out(yopo_input, eta, data).clamp_(_lower, _upper);
+		}
+		auto loss = -1.0 * _hamiltonian(yopo_input, p);
+		loss.backward();
+		return std::make_pair(yopo_input, eta);
+	}
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper)
+	{
+		if (lower >= upper) throw std::invalid_argument("the input range is empty");
+		_lower = lower;
+		_upper = upper;
+	}
+
+	/// true when the N2 loop runs on the analytic Conv2d+ReLU gradient instead of autograd
+	bool uses_analytic_gradient() const { return _analytic_hamiltonian != nullptr; }
+
+	/// <summary>
+	/// Pool of the input-shaped temporaries of the YOPO loops: eta, the inner loop's buffers and the returned
+	/// yopo_input. Callers give eta and yopo_input back once they are done with them.
+	/// </summary>
+	WorkspacePool& workspace() { return _workspace; }
+	const WorkspacePool& workspace() const { return _workspace; }
+
+	void param_zero_grad() { this->_optimizer->zero_grad(); }
+	void param_step() { this->_optimizer->step(); }
+
+	/// the layer-one optimizer's momentum buffers
+	void save(torch::serialize::OutputArchive& archive) { _optimizer->save(archive); }
+	void load(torch::serialize::InputArchive& archive) { _optimizer->load(archive); }
+
+
+private:
+	/// generic N2 loop: differentiates the Hamiltonian of any layer type with autograd
+	torch::Tensor autograd_inner_loop(torch::Tensor data, torch::Tensor p, torch::Tensor eta)
+	{
 		for (int i = 0; i < _N2; ++i)
 		{
-			auto tmp_input = torch::clamp_(data + eta, 0, 1);
+			auto tmp_input = torch::clamp_(data + eta, _lower, _upper);
 			auto H = _hamiltonian(tmp_input, p);
 			auto eta_grad = torch::autograd::grad({ H }, { eta }, {}, false);
 			if (eta_grad.size() < 1) throw std::invalid_argument("autograd::grad failed to compute expected gradients");
 			auto eta_grad_sign = eta_grad[0].sign();
 			eta = eta - eta_grad_sign * _sigma;
 			eta = torch::clamp_(eta, -1 * _epsilon, _epsilon);
-			eta = torch::clamp_(data + eta, 0.0, 1.0) - data;
+			eta = torch::clamp_(data + eta, _lower, _upper) - data;
 			eta.detach_();
 			eta.requires_grad_();
 			eta.retain_grad();
 		}
-		auto yopo_input = torch::clamp(eta + data, 0, 1);
-		auto loss = -1.0 * _hamiltonian(yopo_input, p);
-		loss.backward();
-		return std::make_pair(yopo_input, eta);
+		return eta;
 	}
 
-	void param_zero_grad() { this->_optimizer->zero_grad(); }
-	void param_step() { this->_optimizer->step(); }
+	/// Conv2d+ReLU N2 loop: same update as autograd_inner_loop, with the gradient computed directly. Only the
+	/// two convolutions inside input_gradient allocate; everything else runs on pooled buffers.
+	torch::Tensor analytic_inner_loop(torch::Tensor data, torch::Tensor p, torch::Tensor eta)
+	{
+		torch::NoGradGuard _no_grad_guard;
+		auto next_eta = _workspace.acquire_like(data);
+		auto unclamped = _workspace.acquire_like(data);
+		auto clamped = _workspace.acquire_like(data);
+		auto inside = _workspace.acquire(data.sizes(), data.options().dtype(torch::kBool), data.suggest_memory_format());
+		next_eta.copy_(eta);
+		for (int i = 0; i < _N2; ++i)
+		{
+			torch::add_out(unclamped, data, next_eta);
+			torch::clamp_out(clamped, unclamped, _lower, _upper);
+			auto eta_grad = _analytic_hamiltonian->input_gradient(clamped, p);
+			// clamp only passes the gradient where data + eta lies inside the input range, i.e. where it changed nothing
+			torch::eq_out(inside, unclamped, clamped);
+			eta_grad.mul_(inside);
+			next_eta.sub_(eta_grad.sign_(), _sigma).clamp_(-1 * _epsilon, _epsilon);
+			torch::add_out(unclamped, data, next_eta).clamp_(_lower, _upper);
+			torch::sub_out(next_eta, unclamped, data);
+		}
+		_workspace.release(std::move(unclamped));
+		_workspace.release(std::move(clamped));
+		_workspace.release(std::move(inside));
+		return next_eta;
+	}
 
+	/// the analytic path applies when the layer is exactly a zero-padded Conv2d followed by a ReLU
+	static std::shared_ptr<ConvReLUHamiltonian> make_analytic_hamiltonian(torch::nn::ModuleHolder<LayerType> layer)
+	{
+		if constexpr (std::is_same<LayerType, torch::nn::SequentialImpl>::value)
+		{
+			if (layer->size() == 2 && layer->ptr(0)->template as<torch::nn::Conv2d>() != nullptr &&
+				layer->ptr(1)->template as<torch::nn::ReLU>() != nullptr)
+			{
+				torch::nn::Conv2d conv(layer->template ptr<torch::nn::Conv2dImpl>(0));
+				if (ConvReLUHamiltonian::supports(conv))
+					return std::make_shared<ConvReLUHamiltonian>(conv);
+			}
+		}
+		return nullptr;
+	}
 
-private:
 	Hamiltonian<LayerType> _hamiltonian;
+	std::shared_ptr<ConvReLUHamiltonian> _analytic_hamiltonian;
 	std::shared_ptr<torch::optim::Optimizer> _optimizer;
+	WorkspacePool _workspace;
 	int _N2;
 	double _epsilon;
 	double _sigma;
+	double _lower = 0;
+	double _upper = 1;
 };
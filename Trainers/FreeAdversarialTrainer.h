@@ -0,0 +1,146 @@
+#pragma once
+#include <memory>
+#include <torch/torch.h>
+#include "ITrainer.h"
+#include "utilities.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+
+/// <summary>
+/// "Free" adversarial training (Shafahi et al., 2019). Every minibatch is replayed m times; each replay's single
+/// backward pass yields both the parameter gradients for an optimizer step and the input gradient for a signed
+/// step on the perturbation. The perturbation persists across replays and minibatches, and is only reset when the
+/// batch shape changes, so the attack keeps strengthening without any extra forward or backward passes.
+/// Reports the accuracy on clean inputs and on the perturbed inputs it trained on.
+/// </summary>
+template <typename NetworkType, typename LossModuleType>
+class FreeAdversarialTrainer : public ITrainer
+{
+public:
+	FreeAdversarialTrainer(
+		torch::nn::ModuleHolder<NetworkType> network,
+		std::shared_ptr<torch::optim::Optimizer> optimizer,
+		torch::nn::ModuleHolder<LossModuleType> loss,
+		int replays,
+		double epsilon,
+		c10::Device device = c10::kCPU) :
+		_network(network), _optimizer(optimizer), _loss(loss), _replays(replays), _epsilon(epsilon), _device(device)
+	{
+		if (replays < 1) throw std::invalid_argument("free adversarial training needs at least one replay");
+	}
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper)
+	{
+		if (lower >= upper) throw std::invalid_argument("the input range is empty");
+		_lower = lower;
+		_upper = upper;
+	}
+
+	void train_batch(torch::data::Example<> example)
+	{
+		auto data = example.data.to(_device);
+		auto labels = example.target.to(_device);
+		// every replay's single backward pass serves the weight update and the attack alike
+		PROFILE_PHASE("weight update");
+		if (!_eta.defined() || !_eta.is_same_size(data) || _eta.device() != data.device())
+			_eta = torch::zeros_like(data);
+
+		_network->train();
+		{ PROFILE_SCOPE("forward");
+			torch::NoGradGuard _nogradguard;
+			auto prediction = _network(data);
+			_clean_accuracy.update(count_torch_correct(prediction, labels), data.size(0));
+			_clean_loss.update(_loss(prediction, labels) * data.size(0), data.size(0));
+		}
+
+		for (int i = 0; i < _replays; ++i)
+		{
+			auto adversarial_input = torch::clamp(data + _eta, _lower, _upper).requires_grad_();
+			torch::Tensor prediction, loss;
+			{ PROFILE_SCOPE("forward");
+				prediction = _network(adversarial_input);
+				loss = _loss(prediction, labels);
+			}
+			{ PROFILE_SCOPE("backward");
+				_optimizer->zero_grad();
+				loss.backward();
+			}
+			{ PROFILE_SCOPE("optimizer step");
+				synchronize_gradients();
+				_optimizer->step();
+			}
+			{ PROFILE_SCOPE("attack generation");
+				torch::NoGradGuard _nogradguard;
+				_eta.add_(adversarial_input.grad().sign(), _epsilon).clamp_(-_epsilon, _epsilon);
+			}
+			if (i == _replays - 1)
+			{
+				PROFILE_SCOPE("accuracy");
+				_adversarial_accuracy.update(count_torch_correct(prediction, labels), data.size(0));
+				_adversarial_loss.update(loss * data.size(0), data.size(0));
+			}
+		}
+	}
+
+	std::pair<double, double> get_accuracies()
+	{
+		return std::make_pair(_clean_accuracy.getMean() * 100, _adversarial_accuracy.getMean() * 100);
+	}
+
+	std::pair<double, double> get_losses()
+	{
+		return std::make_pair(_clean_loss.getMean(), _adversarial_loss.getMean());
+	}
+
+	void reset_metrics()
+	{
+		_clean_accuracy.reset();
+		_adversarial_accuracy.reset();
+		_clean_loss.reset();
+		_adversarial_loss.reset();
+	}
+
+	/// the persistent perturbation is part of the training state, so it is checkpointed too
+	void save(torch::serialize::OutputArchive& archive)
+	{
+		torch::serialize::OutputArchive optimizer;
+		_optimizer->save(optimizer);
+		archive.write("optimizer", optimizer);
+		archive.write("eta", _eta.defined() ? _eta : torch::empty({ 0 }), /*is_buffer*/ true);
+		_clean_accuracy.save(archive, "clean_accuracy");
+		_adversarial_accuracy.save(archive, "adversarial_accuracy");
+		_clean_loss.save(archive, "clean_loss");
+		_adversarial_loss.save(archive, "adversarial_loss");
+	}
+
+	void load(torch::serialize::InputArchive& archive)
+	{
+		torch::serialize::InputArchive optimizer;
+		archive.read("optimizer", optimizer);
+		_optimizer->load(optimizer);
+		torch::Tensor eta;
+		if (archive.try_read("eta", eta, /*is_buffer*/ true) && eta.defined() && eta.numel() > 0)
+			_eta = eta.to(_device);
+		_clean_accuracy.load(archive, "clean_accuracy");
+		_adversarial_accuracy.load(archive, "adversarial_accuracy");
+		_clean_loss.load(archive, "clean_loss");
+		_adversarial_loss.load(archive, "adversarial_loss");
+	}
+
+private:
+	torch::nn::ModuleHolder<NetworkType> _network;
+	std::shared_ptr<torch::optim::Optimizer> _optimizer;
+	torch::nn::ModuleHolder<LossModuleType> _loss;
+	int _replays;
+	double _epsilon;
+	c10::Device _device;
+	double _lower = 0;
+	double _upper = 1;
+	torch::Tensor _eta;
+
+	device_meter _clean_accuracy = device_meter("clean accuracy");
+	device_meter _adversarial_accuracy = device_meter("adversarial accuracy");
+	device_meter _clean_loss = device_meter("clean loss");
+	device_meter _adversarial_loss = device_meter("adversarial loss");
+};
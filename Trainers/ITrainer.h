@@ -1,12 +1,42 @@
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <torch/torch.h>
+#include "WorkspacePool.h"
 
 
 class ITrainer
 {
 public:
 	virtual void train_batch(torch::data::Example<> example) = 0;
+	/// clean and adversarial accuracy (%) and mean loss over the batches since the last reset_metrics
 	virtual std::pair<double, double> get_accuracies() = 0;
+	virtual std::pair<double, double> get_losses() = 0;
+	virtual void reset_metrics() = 0;
+
+	/// checkpoints the training state besides the network itself: optimizer state and meters
+	virtual void save(torch::serialize::OutputArchive& archive) = 0;
+	virtual void load(torch::serialize::InputArchive& archive) = 0;
+
+	/// true once the trainer has detected that further training would do harm, e.g. catastrophic overfitting
+	virtual bool should_stop() { return false; }
+
+	/// the pool the trainer or its attack draws per-iteration temporaries from, if there is one
+	virtual const WorkspacePool* workspace() const { return nullptr; }
+
+	/// <summary>
+	/// Called after the backward passes and before every optimizer step, including auxiliary optimizers such as
+	/// YOPO's layer-one optimizer; data-parallel training all-reduces the gradients here.
+	/// </summary>
+	void set_gradient_synchronizer(std::function<void()> synchronizer) { _synchronize_gradients = synchronizer; }
+
+protected:
+	void synchronize_gradients()
+	{
+		if (_synchronize_gradients) _synchronize_gradients();
+	}
+
+private:
+	std::function<void()> _synchronize_gradients;
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include <type_traits>
+#include <utility>
+#include <torch/torch.h>
+
+namespace layer_one_detail
+{
+	template <typename NetworkType, typename = void>
+	struct has_layer_one_split : std::false_type {};
+
+	template <typename NetworkType>
+	struct has_layer_one_split<NetworkType, std::void_t<
+		decltype(std::declval<NetworkType&>().layer_one()),
+		decltype(std::declval<NetworkType&>().forward_layer_one(std::declval<torch::Tensor>())),
+		decltype(std::declval<NetworkType&>().forward_from_layer_one(std::declval<torch::Tensor>()))>> : std::true_type {};
+}
+
+/// <summary>
+/// Tells YOPOTrainer where a network's first layer ends. YOPO runs layer one outside the autograd graph, reads the
+/// adjoint p from the gradient that reaches its output and trains it separately through the Hamiltonian.
+///   LayerType                      the module type of layer one, which the Hamiltonian differentiates
+///   layer_one(network)             layer one, sharing the network's parameters
+///   forward_layer_one(network, x)  the network's input up to and including layer one
+///   forward_from_layer_one(net, y) the rest of the network, from layer one's output to the logits
+/// Networks that expose layer_one(), forward_layer_one() and forward_from_layer_one() and networks built as a
+/// torch::nn::Sequential work as they are; any other network needs a specialization.
+/// </summary>
+template <typename NetworkType, typename Enable = void>
+struct LayerOneTraits
+{
+	static_assert(sizeof(NetworkType) == 0,
+		"specialize LayerOneTraits, or expose layer_one(), forward_layer_one() and forward_from_layer_one()");
+};
+
+/// networks that split their own forward pass at layer one, e.g. SmallCNN
+template <typename NetworkType>
+struct LayerOneTraits<NetworkType, std::enable_if_t<layer_one_detail::has_layer_one_split<NetworkType>::value>>
+{
+	using LayerType = typename decltype(std::declval<NetworkType&>().layer_one())::ContainedType;
+
+	static torch::nn::ModuleHolder<LayerType> layer_one(NetworkType& network) { return network.layer_one(); }
+	static torch::Tensor forward_layer_one(NetworkType& network, const torch::Tensor& x) { return network.forward_layer_one(x); }
+	static torch::Tensor forward_from_layer_one(NetworkType& network, const torch::Tensor& y) { return network.forward_from_layer_one(y); }
+};
+
+/// <summary>
+/// Sequential networks: layer one is the first module, together with the activation right after it, so that a
+/// leading Conv2d and ReLU take the analytic Hamiltonian path.
+/// </summary>
+template <typename NetworkType>
+struct LayerOneTraits<NetworkType, std::enable_if_t<
+	std::is_base_of<torch::nn::SequentialImpl, NetworkType>::value && !layer_one_detail::has_layer_one_split<NetworkType>::value>>
+{
+	using LayerType = torch::nn::SequentialImpl;
+
+	static torch::nn::Sequential layer_one(NetworkType& network)
+	{
+		torch::nn::Sequential layer;
+		for (size_t i = 0; i < layer_one_size(network); ++i)
+			layer->push_back(*(network.begin() + i));
+		return layer;
+	}
+
+	static torch::Tensor forward_layer_one(NetworkType& network, torch::Tensor x)
+	{
+		for (size_t i = 0; i < layer_one_size(network); ++i)
+			x = (network.begin() + i)->template forward<torch::Tensor>(x);
+		return x;
+	}
+
+	static torch::Tensor forward_from_layer_one(NetworkType& network, torch::Tensor y)
+	{
+		for (auto module = network.begin() + layer_one_size(network); module != network.end(); ++module)
+			y = module->template forward<torch::Tensor>(y);
+		return y;
+	}
+
+private:
+	static size_t layer_one_size(NetworkType& network)
+	{
+		if (network.size() < 2) throw std::invalid_argument("YOPO needs a network with layers after layer one");
+		bool activation = network.size() > 2 && (network.ptr(1)->template as<torch::nn::ReLU>() != nullptr);
+		return activation ? 2 : 1;
+	}
+};
@@ -4,6 +4,9 @@
 #include "ITrainer.h"
 #include "utilities.h"
 #include "Loss.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+#include "MixedPrecision.h"
 
 
 template <typename NetworkType, typename LossModuleType>
@@ -15,46 +18,140 @@ public:
 		std::shared_ptr<IAttacker<NetworkType>> attacker,
 		std::shared_ptr<torch::optim::Optimizer> optimizer,
 		torch::nn::ModuleHolder<LossModuleType> loss,
-		c10::Device device = c10::kCPU) :
+		c10::Device device = c10::kCPU,
+		ComputePrecision precision = ComputePrecision::FP32) :
 		_network(network), _attacker(attacker), _device(device), _loss(loss), _optimizer(optimizer)
-	{}
+	{
+		if (precision == ComputePrecision::BF16)
+			_replica = std::make_unique<LowPrecisionReplica<NetworkType>>(network);
+	}
 
 	void train_batch(torch::data::Example<> example)
 	{
 		auto data = example.data.to(_device);
 		auto label = example.target.to(_device);
+		PROFILE_PHASE("weight update");
 		(*_optimizer).zero_grad();
 
-		if (_attacker->getType() != AttackType::Noop)
+		// every chunk's losses are scaled by its share of the batch, so the accumulated gradients are the batch's
+		for (auto& chunk : split_batch(data, label, _micro_batch_size))
 		{
-			auto adversarial_input = (*_attacker)(_network, data, label);
-			_optimizer->zero_grad();
-			_network->train();
-			auto prediction = _network(adversarial_input);
-			auto loss = _loss(prediction, label);
-			loss.backward();
-			_adversarial_accuracy.update(calculate_torch_accuracy(prediction, label), false);
+			auto chunk_size = chunk.data.size(0);
+			double share = static_cast<double>(chunk_size) / data.size(0);
+
+			if (_attacker->getType() != AttackType::Noop)
+			{
+				torch::Tensor adversarial_input;
+				{ PROFILE_SCOPE("attack generation");
+					PROFILE_PHASE("attack");
+					adversarial_input = (*_attacker)(_network, chunk.data, chunk.target);
+				}
+				_network->train();
+				torch::Tensor prediction, loss;
+				{ PROFILE_SCOPE("forward");
+					prediction = forward(adversarial_input);
+					loss = _loss(prediction, chunk.target);
+				}
+				{ PROFILE_SCOPE("backward");
+					(loss * share).backward();
+				}
+				{ PROFILE_SCOPE("accuracy");
+					_adversarial_accuracy.update(count_torch_correct(prediction, chunk.target), chunk_size);
+					_adversarial_loss.update(loss * chunk_size, chunk_size);
+				}
+			}
+
+			torch::Tensor prediction, loss;
+			{ PROFILE_SCOPE("forward");
+				prediction = forward(chunk.data);
+				loss = _loss(prediction, chunk.target);
+			}
+			{ PROFILE_SCOPE("backward");
+				(loss * share).backward();
+			}
+			{ PROFILE_SCOPE("accuracy");
+				_clean_accuracy.update(count_torch_correct(prediction, chunk.target), chunk_size);
+				_clean_loss.update(loss * chunk_size, chunk_size);
+			}
 		}
 
-		auto prediction = _network(data);
-		auto loss = _loss(prediction, label);
-		loss.backward();
-		_optimizer->step();
-		_clean_accuracy.update(calculate_torch_accuracy(prediction, label), false);
+		{ PROFILE_SCOPE("optimizer step");
+			if (_replica) _replica->push_gradients();
+			synchronize_gradients();
+			_optimizer->step();
+			if (_replica) _replica->pull();
+		}
 	}
 
+	/// <summary>
+	/// Runs each batch in chunks of at most microBatchSize samples: the attack, forward and backward passes of one
+	/// chunk finish before the next starts, and parameter gradients accumulate over the chunks into one optimizer
+	/// step. Peak memory then scales with the chunk size rather than the batch size. 0 disables micro-batching.
+	/// </summary>
+	void set_micro_batch_size(int64_t microBatchSize) { _micro_batch_size = microBatchSize; }
+
 	std::pair<double, double> get_accuracies()
 	{
-		return std::make_pair(_clean_accuracy.getMean(), _adversarial_accuracy.getMean());
+		return std::make_pair(_clean_accuracy.getMean() * 100, _adversarial_accuracy.getMean() * 100);
+	}
+
+	std::pair<double, double> get_losses()
+	{
+		return std::make_pair(_clean_loss.getMean(), _adversarial_loss.getMean());
+	}
+
+	const WorkspacePool* workspace() const { return _attacker->workspace(); }
+
+	void reset_metrics()
+	{
+		_clean_accuracy.reset();
+		_adversarial_accuracy.reset();
+		_clean_loss.reset();
+		_adversarial_loss.reset();
+	}
+
+	void save(torch::serialize::OutputArchive& archive)
+	{
+		torch::serialize::OutputArchive optimizer;
+		_optimizer->save(optimizer);
+		archive.write("optimizer", optimizer);
+		_clean_accuracy.save(archive, "clean_accuracy");
+		_adversarial_accuracy.save(archive, "adversarial_accuracy");
+		_clean_loss.save(archive, "clean_loss");
+		_adversarial_loss.save(archive, "adversarial_loss");
+	}
+
+	void load(torch::serialize::InputArchive& archive)
+	{
+		torch::serialize::InputArchive optimizer;
+		archive.read("optimizer", optimizer);
+		_optimizer->load(optimizer);
+		_clean_accuracy.load(archive, "clean_accuracy");
+		_adversarial_accuracy.load(archive, "adversarial_accuracy");
+		_clean_loss.load(archive, "clean_loss");
+		_adversarial_loss.load(archive, "adversarial_loss");
 	}
 
 private:
+	/// fp32 logits, computed on the bf16 replica in BF16 mode
+	torch::Tensor forward(const torch::Tensor& x)
+	{
+		if (!_replica) return _network(x);
+		_replica->replica()->train(_network->is_training());
+		return (*_replica)(x);
+	}
+
 	torch::nn::ModuleHolder<NetworkType> _network;
+	std::unique_ptr<LowPrecisionReplica<NetworkType>> _replica;
+	int64_t _micro_batch_size = 0;
 	std::shared_ptr<IAttacker<NetworkType>> _attacker;
 	std::shared_ptr<torch::optim::Optimizer> _optimizer;
 	torch::nn::ModuleHolder<LossModuleType> _loss;
 	c10::Device _device;
 
-	average_meter _clean_accuracy = average_meter("Clean accuracy");
-	average_meter _adversarial_accuracy = average_meter("Adversarial accuracy");
+	// accuracies count correct predictions; all four stay on the device until they are printed
+	device_meter _clean_accuracy = device_meter("Clean accuracy");
+	device_meter _adversarial_accuracy = device_meter("Adversarial accuracy");
+	device_meter _clean_loss = device_meter("Clean loss");
+	device_meter _adversarial_loss = device_meter("Adversarial loss");
 };
\ No newline at end of file
@@ -3,8 +3,12 @@
 #include <torch/torch.h>
 #include "ITrainer.h"
 #include "FastGradientSingleLayerTrainer.h"
+#include "LayerOneTraits.h"
 #include "utilities.h"
 #include "Loss.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+#include "MixedPrecision.h"
 
 template <typename NetworkType, typename LossModuleType>
 class YOPOTrainer : public ITrainer
@@ -23,83 +27,197 @@ public:
 		int N2,
 		double sigma,
 		double epsilon,
-		c10::Device device = c10::kCPU) :
+		c10::Device device = c10::kCPU,
+		ComputePrecision precision = ComputePrecision::FP32) :
 		_network(network), 
 		_loss(loss),
 		_optimizer(optimizer),
 		_device(device),
 		_layer_one_trainer(
-			network->layer_one(),
+			LayerOneTraits<NetworkType>::layer_one(*network),
 			sigma,
 			epsilon,
 			N2),
 		_K(K), 
 		_epsilon(epsilon)
-	{}
+	{
+		if (precision == ComputePrecision::BF16)
+			_replica = std::make_unique<LowPrecisionReplica<NetworkType>>(network);
+	}
 
 	void train_batch(torch::data::Example<> example)
 	{
-		auto data = example.data; data.to(_device);
-		auto labels = example.target; labels.to(_device);
-
-		auto eta = (torch::rand_like(data) - 0.5) * 2 * _epsilon;
-		eta.to(_device);
-		eta.requires_grad_();
+		auto batch_data = example.data.to(_device);
+		auto batch_labels = example.target.to(_device);
+		PROFILE_PHASE("yopo outer K");
 
 		_optimizer->zero_grad();
 		_layer_one_trainer.param_zero_grad();
 
-		for (int j = 0; j < _K; ++j)
+		// every chunk's loss is scaled by its share of the batch; p, and with it the layer-one gradients, scale along
+		for (auto& chunk : split_batch(batch_data, batch_labels, _micro_batch_size))
 		{
-			auto pred = _network(data + eta.detach());
-			auto loss = _loss(pred, labels);
-
-			// next line obtains p for the Hamiltonian
-			auto p = -1.0 * _network->layer_one_output().grad();
-			
-			auto toggleConv1RequiresGrad = [&](bool requiresGrad) {
-				this->_network->conv1()->named_parameters()["weight"].requires_grad_(requiresGrad);
-			};
-			toggleConv1RequiresGrad(false);
-			loss.backward();
-			toggleConv1RequiresGrad(true);
-			 
-			torch::Tensor yopo_input, eta;
-			std::tie(yopo_input, eta) = _layer_one_trainer.step(data, p, eta);
-
-			{	
-				torch::NoGradGuard ngg;
-				if (j == 0)
-				{
-					_clean_accuracy.update(calculate_torch_accuracy(pred, labels), false);
+			auto data = chunk.data;
+			auto labels = chunk.target;
+			double share = static_cast<double>(data.size(0)) / batch_data.size(0);
+
+			auto& workspace = _layer_one_trainer.workspace();
+			torch::Tensor eta = workspace.acquire_like(data);
+			{ torch::NoGradGuard _nogradguard;
+				eta.uniform_(-_epsilon, _epsilon);
+			}
+			// only the autograd inner loop differentiates with respect to eta
+			if (!_layer_one_trainer.uses_analytic_gradient()) eta.requires_grad_();
+
+			for (int j = 0; j < _K; ++j)
+			{
+				// p, the adjoint for the Hamiltonian, is the negated loss gradient at layer one's output
+				torch::Tensor pred, unscaled_loss, loss, p;
+				{ PROFILE_SCOPE("forward");
+					pred = split_forward(data + eta.detach(), p);
+					unscaled_loss = _loss(pred, labels);
+					loss = unscaled_loss * share;
+				}
+				{ PROFILE_SCOPE("backward");
+					loss.backward();
+				}
+
+				torch::Tensor yopo_input, next_eta;
+				{ PROFILE_SCOPE("attack generation");
+					std::tie(yopo_input, next_eta) = _layer_one_trainer.step(data, p, eta);
 				}
-				if (j == _K - 1)
+				workspace.release(std::move(eta));
+				eta = std::move(next_eta);
+
 				{
-					auto yopo_pred = _network(yopo_input);
-					_yopo_accuracy.update(calculate_torch_accuracy(yopo_pred, labels), false);
+					PROFILE_SCOPE("accuracy");
+					PROFILE_PHASE("metrics");
+					torch::NoGradGuard ngg;
+					if (j == 0)
+					{
+						_clean_accuracy.update(count_torch_correct(pred, labels), data.size(0));
+						_clean_loss.update(unscaled_loss * data.size(0), data.size(0));
+					}
+					if (j == _K - 1)
+					{
+						auto yopo_pred = forward(yopo_input);
+						_yopo_accuracy.update(count_torch_correct(yopo_pred, labels), data.size(0));
+						_yopo_loss.update(_loss(yopo_pred, labels) * data.size(0), data.size(0));
+					}
 				}
+				workspace.release(std::move(yopo_input));
 			}
+			workspace.release(std::move(eta));
+		}
+		{ PROFILE_SCOPE("optimizer step");
+			if (_replica) _replica->push_gradients();
+			// the layer-one parameters belong to the network, so one synchronization serves both optimizers
+			synchronize_gradients();
+			_optimizer->step();
+			_layer_one_trainer.param_step();
+			if (_replica) _replica->pull();
 		}
-		_optimizer->step();
-		_layer_one_trainer.param_step();
 		_optimizer->zero_grad();
 		_layer_one_trainer.param_zero_grad();
 	}
 
+	/// runs each batch in chunks of at most microBatchSize samples, each with its own K iterations, accumulating
+	/// gradients into one optimizer step; 0 disables micro-batching
+	void set_micro_batch_size(int64_t microBatchSize) { _micro_batch_size = microBatchSize; }
+
+	/// bounds of valid inputs, e.g. MappedMNIST::input_range() for normalized images; [0, 1] by default
+	void set_input_range(double lower, double upper) { _layer_one_trainer.set_input_range(lower, upper); }
+
 	std::pair<double, double> get_accuracies()
 	{
-		return std::make_pair(_clean_accuracy.getMean(), _yopo_accuracy.getMean());
+		return std::make_pair(_clean_accuracy.getMean() * 100, _yopo_accuracy.getMean() * 100);
+	}
+
+	std::pair<double, double> get_losses()
+	{
+		return std::make_pair(_clean_loss.getMean(), _yopo_loss.getMean());
+	}
+
+	const WorkspacePool* workspace() const { return &_layer_one_trainer.workspace(); }
+
+	void reset_metrics()
+	{
+		_clean_accuracy.reset();
+		_yopo_accuracy.reset();
+		_clean_loss.reset();
+		_yopo_loss.reset();
+	}
+
+	void save(torch::serialize::OutputArchive& archive)
+	{
+		torch::serialize::OutputArchive optimizer, layer_one;
+		_optimizer->save(optimizer);
+		_layer_one_trainer.save(layer_one);
+		archive.write("optimizer", optimizer);
+		archive.write("layer_one", layer_one);
+		_clean_accuracy.save(archive, "clean_accuracy");
+		_yopo_accuracy.save(archive, "yopo_accuracy");
+		_clean_loss.save(archive, "clean_loss");
+		_yopo_loss.save(archive, "yopo_loss");
+	}
+
+	void load(torch::serialize::InputArchive& archive)
+	{
+		torch::serialize::InputArchive optimizer, layer_one;
+		archive.read("optimizer", optimizer);
+		archive.read("layer_one", layer_one);
+		_optimizer->load(optimizer);
+		_layer_one_trainer.load(layer_one);
+		_clean_accuracy.load(archive, "clean_accuracy");
+		_yopo_accuracy.load(archive, "yopo_accuracy");
+		_clean_loss.load(archive, "clean_loss");
+		_yopo_loss.load(archive, "yopo_loss");
 	}
 
 private:
+	/// the module the K forward/backward passes run on: the network itself, or its bf16 replica in BF16 mode.
+	/// The layer-one trainer always updates the fp32 network's first layer.
+	torch::nn::ModuleHolder<NetworkType> model() { return _replica ? _replica->replica() : _network; }
+
+	torch::Tensor forward(const torch::Tensor& x)
+	{
+		if (!_replica) return _network(x);
+		_replica->replica()->train(_network->is_training());
+		return (*_replica)(x);
+	}
+
+	/// <summary>
+	/// Forward pass with layer one outside the autograd graph: layer one's weights are trained through the
+	/// Hamiltonian alone, so the backward pass stops at its output. A one-shot hook on that output stores the
+	/// negated gradient into p during backward; no activation outlives the iteration.
+	/// </summary>
+	torch::Tensor split_forward(const torch::Tensor& x, torch::Tensor& p)
+	{
+		using Traits = LayerOneTraits<NetworkType>;
+		auto network = model();
+		network->train(_network->is_training());
+
+		torch::Tensor layer_one_output;
+		{ torch::NoGradGuard _nogradguard;
+			layer_one_output = Traits::forward_layer_one(*network, _replica ? x.to(_replica->dtype()) : x);
+		}
+		layer_one_output.requires_grad_();
+		layer_one_output.register_hook([&p](torch::Tensor gradient) { p = gradient.to(torch::kFloat).neg(); });
+		return Traits::forward_from_layer_one(*network, layer_one_output).to(torch::kFloat);
+	}
+
 	torch::nn::ModuleHolder<NetworkType> _network;
-	FastGradientSingleLayerTrainer<torch::nn::SequentialImpl> _layer_one_trainer;
+	std::unique_ptr<LowPrecisionReplica<NetworkType>> _replica;
+	int64_t _micro_batch_size = 0;
+	FastGradientSingleLayerTrainer<typename LayerOneTraits<NetworkType>::LayerType> _layer_one_trainer;
 	torch::nn::ModuleHolder<LossModuleType> _loss;
 	std::shared_ptr<torch::optim::Optimizer> _optimizer;
 	int _K;
 	double _epsilon;
-	average_meter _clean_accuracy = average_meter("clean accuracy");
-	average_meter _yopo_accuracy = average_meter("yopo accuracy");
+	device_meter _clean_accuracy = device_meter("clean accuracy");
+	device_meter _yopo_accuracy = device_meter("yopo accuracy");
+	device_meter _clean_loss = device_meter("clean loss");
+	device_meter _yopo_loss = device_meter("yopo loss");
 
 	c10::Device _device;
 };
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <torch/torch.h>
+
+/// <summary>
+/// Hands out uninitialized tensors keyed by shape, dtype, device and memory format, and takes them back for reuse,
+/// so that same-shaped temporaries of attack and training iterations are allocated once instead of on every
+/// iteration and batch. A returned tensor is only pooled when nothing else references its storage (no view, no
+/// autograd graph); otherwise it is left to be freed normally. Pooled buffers beyond capacityBytes are dropped,
+/// least recently returned first. Not thread-safe: every attacker and trainer owns its pool.
+/// </summary>
+class WorkspacePool
+{
+public:
+	WorkspacePool(int64_t capacityBytes = int64_t(1) << 28) : _capacityBytes(capacityBytes) {}
+
+	WorkspacePool(const WorkspacePool&) = delete;
+	WorkspacePool& operator=(const WorkspacePool&) = delete;
+
+	/// an uninitialized tensor of the given shape and options, reused from the pool when one is available
+	torch::Tensor acquire(torch::IntArrayRef sizes, const torch::TensorOptions& options, c10::MemoryFormat format = c10::MemoryFormat::Contiguous)
+	{
+		if (std::find(sizes.begin(), sizes.end(), 0) != sizes.end()) return torch::empty(sizes, options.memory_format(format));
+		Key key{ sizes.vec(), options.dtype().toScalarType(), options.device(), format };
+		auto found = std::find_if(_pooled.rbegin(), _pooled.rend(), [&](const Entry& entry) { return entry.key == key; });
+		torch::Tensor tensor;
+		if (found != _pooled.rend())
+		{
+			tensor = std::move(found->tensor);
+			_pooledBytes -= bytes(tensor);
+			_pooled.erase(std::next(found).base());
+			++_reuses;
+		}
+		else
+		{
+			tensor = torch::empty(sizes, options.memory_format(format));
+			++_allocations;
+		}
+		_inUseBytes += bytes(tensor);
+		// an entry at the same address belongs to a tensor that was dropped without being released and whose memory
+		// the allocator handed out again; it is stale, so it is replaced and no longer counted as in use
+		auto handedOut = _handedOut.find(tensor.data_ptr());
+		if (handedOut != _handedOut.end())
+		{
+			_inUseBytes -= bytes(handedOut->second);
+			handedOut->second = std::move(key);
+		}
+		else
+		{
+			_handedOut.emplace(tensor.data_ptr(), std::move(key));
+		}
+		_peakBytes = std::max(_peakBytes, _inUseBytes + _pooledBytes);
+		return tensor;
+	}
+
+	/// same shape, dtype, device and memory format as like
+	torch::Tensor acquire_like(const torch::Tensor& like)
+	{
+		return acquire(like.sizes(), like.options(), like.suggest_memory_format());
+	}
+
+	/// gives a tensor obtained from acquire back; the caller's handle is cleared
+	void release(torch::Tensor&& tensor)
+	{
+		torch::Tensor returned = std::move(tensor);
+		if (!returned.defined()) return;
+		auto handedOut = _handedOut.find(returned.data_ptr());
+		if (handedOut == _handedOut.end()) return;
+		auto key = std::move(handedOut->second);
+		_handedOut.erase(handedOut);
+		_inUseBytes -= bytes(returned);
+		// a tensor still referenced elsewhere, or part of an autograd graph, must not be handed out again
+		if (returned.use_count() != 1 || returned.storage().use_count() != 1 || returned.requires_grad()) return;
+		// a view at the same address, or a tensor never released whose memory was reused, has another shape
+		if (returned.sizes() != torch::IntArrayRef(key.sizes) || returned.scalar_type() != key.dtype ||
+			returned.device() != key.device || !returned.is_contiguous(key.format))
+			return;
+
+		_pooledBytes += bytes(returned);
+		_pooled.push_back({ std::move(key), std::move(returned) });
+		while (_pooledBytes > _capacityBytes && !_pooled.empty())
+		{
+			_pooledBytes -= bytes(_pooled.front().tensor);
+			_pooled.pop_front();
+		}
+	}
+
+	/// drops every pooled buffer; buffers in use stay valid
+	void trim()
+	{
+		_pooled.clear();
+		_pooledBytes = 0;
+	}
+
+	/// bytes held by the pool now, in use and pooled; read between batches it is the steady-state footprint
+	int64_t footprint_bytes() const { return _inUseBytes + _pooledBytes; }
+	int64_t peak_bytes() const { return _peakBytes; }
+	int64_t allocations() const { return _allocations; }
+	int64_t reuses() const { return _reuses; }
+
+	std::string report() const
+	{
+		std::ostringstream line;
+		line << "workspace: " << _allocations << " allocations, " << _reuses << " reuses, peak "
+			<< _peakBytes / 1048576.0 << " MiB, steady state " << footprint_bytes() / 1048576.0 << " MiB";
+		return line.str();
+	}
+
+private:
+	struct Key
+	{
+		std::vector<int64_t> sizes;
+		c10::ScalarType dtype;
+		c10::Device device;
+		c10::MemoryFormat format;
+
+		bool operator==(const Key& other) const
+		{
+			return sizes == other.sizes && dtype == other.dtype && device == other.device && format == other.format;
+		}
+	};
+
+	struct Entry
+	{
+		Key key;
+		torch::Tensor tensor;
+	};
+
+	static int64_t bytes(const torch::Tensor& tensor) { return tensor.numel() * tensor.element_size(); }
+
+	static int64_t bytes(const Key& key)
+	{
+		int64_t numel = 1;
+		for (auto size : key.sizes) numel *= size;
+		return numel * static_cast<int64_t>(c10::elementSize(key.dtype));
+	}
+
+	int64_t _capacityBytes;
+	// few distinct shapes per owner, so a list searched from the most recently returned end is enough
+	std::list<Entry> _pooled;
+	std::unordered_map<const void*, Key> _handedOut;
+	int64_t _pooledBytes = 0;
+	int64_t _inUseBytes = 0;
+	int64_t _peakBytes = 0;
+	int64_t _allocations = 0;
+	int64_t _reuses = 0;
+};
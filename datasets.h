@@ -1,4 +1,297 @@
 #pragma once
 #include <torch/torch.h>
 #include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// Private, copy-on-write memory mapping of an entire file: pages are read from the file on first access, and a
+/// write to the mapping copies the page for this process and never reaches the file. Writable pages keep tensors
+/// that view the mapping usable by in-place operators instead of faulting. The mapping is released when the object
+/// is destroyed, so tensors that view into it must hold a shared_ptr to the MappedFile.
+/// </summary>
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& path)
+	{
+#ifdef _WIN32
+		// a copy-on-write mapping only needs read access to the file
+		_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE) fail("unable to open " + path);
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(_file, &size)) fail("unable to read the size of " + path);
+		_size = static_cast<size_t>(size.QuadPart);
+		_mapping = CreateFileMappingA(_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+		if (_mapping == nullptr) fail("unable to map " + path);
+		_data = static_cast<uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_COPY, 0, 0, 0));
+#else
+		_file = open(path.c_str(), O_RDONLY);
+		if (_file < 0) fail("unable to open " + path);
+		struct stat status;
+		if (fstat(_file, &status) != 0) fail("unable to read the size of " + path);
+		_size = static_cast<size_t>(status.st_size);
+		void* data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, _file, 0);
+		_data = data == MAP_FAILED ? nullptr : static_cast<uint8_t*>(data);
+#endif
+		if (_data == nullptr) fail("unable to map " + path);
+	}
+
+	~MappedFile() { release(); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	uint8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+
+private:
+	void release()
+	{
+#ifdef _WIN32
+		if (_data) UnmapViewOfFile(_data);
+		if (_mapping) CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+		_mapping = nullptr;
+		_file = INVALID_HANDLE_VALUE;
+#else
+		if (_data) munmap(_data, _size);
+		if (_file >= 0) close(_file);
+		_file = -1;
+#endif
+		_data = nullptr;
+	}
+
+	/// the destructor does not run for a constructor that throws, so whatever was opened is released here
+	[[noreturn]] void fail(const std::string& message)
+	{
+		release();
+		throw std::runtime_error(message);
+	}
+
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+#else
+	int _file = -1;
+#endif
+	uint8_t* _data = nullptr;
+	size_t _size = 0;
+};
+
+/// <summary>
+/// MNIST split that is decoded and normalized once, stored contiguously on disk and served from a memory mapping.
+/// The first construction reads the raw MNIST files from root and writes the store to storePath; later
+/// constructions only map it. A batch of consecutive indices is a zero-copy view into the mapping, any other batch
+/// is a single index gather. Writes to a view stay private to this process but change the dataset for every later
+/// batch, so callers that modify batches in place copy the views first (see is_view).
+/// </summary>
+class MappedMNIST : public torch::data::datasets::BatchDataset<MappedMNIST, torch::data::Example<>>
+{
+public:
+	MappedMNIST(
+		const std::string& root,
+		torch::data::datasets::MNIST::Mode mode,
+		const std::string& storePath,
+		double mean = 0.5,
+		double standard_deviation = 0.5)
+	{
+		if (!is_valid_store(storePath, mean, standard_deviation))
+			write_store(root, mode, storePath, mean, standard_deviation);
+
+		auto file = std::make_shared<MappedFile>(storePath);
+		StoreHeader header;
+		std::memcpy(&header, file->data(), sizeof(header));
+		_count = static_cast<size_t>(header.count);
+		_mean = header.mean;
+		_standard_deviation = header.standard_deviation;
+
+		// the deleter keeps the mapping alive for as long as any view into it exists
+		auto keep_alive = [file](void*) {};
+		_images = torch::from_blob(
+			file->data() + header.images_offset,
+			{ static_cast<int64_t>(header.count), header.channels, header.rows, header.columns },
+			keep_alive,
+			torch::TensorOptions().dtype(torch::kFloat32));
+		_labels = torch::from_blob(
+			file->data() + header.labels_offset,
+			{ static_cast<int64_t>(header.count) },
+			keep_alive,
+			torch::TensorOptions().dtype(torch::kInt64));
+	}
+
+	torch::data::Example<> get_batch(c10::ArrayRef<size_t> indices) override
+	{
+		if (indices.empty()) throw std::invalid_argument("cannot produce an empty batch");
+
+		bool consecutive = true;
+		for (size_t i = 1; i < indices.size() && consecutive; ++i)
+			consecutive = indices[i] == indices[0] + i;
+		if (consecutive)
+		{
+			if (indices.back() >= _count) throw std::out_of_range("batch index out of range");
+			auto start = static_cast<int64_t>(indices[0]);
+			auto length = static_cast<int64_t>(indices.size());
+			return { _images.narrow(0, start, length), _labels.narrow(0, start, length) };
+		}
+
+		auto index = torch::empty({ static_cast<int64_t>(indices.size()) }, torch::kInt64);
+		auto index_data = index.data_ptr<int64_t>();
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			if (indices[i] >= _count) throw std::out_of_range("batch index out of range");
+			index_data[i] = static_cast<int64_t>(indices[i]);
+		}
+		return { _images.index_select(0, index), _labels.index_select(0, index) };
+	}
+
+	c10::optional<size_t> size() const override { return _count; }
+
+	torch::Tensor images() const { return _images; }
+	torch::Tensor targets() const { return _labels; }
+
+	/// samples [begin, end) as a dataset of their own, viewing the same mapping
+	MappedMNIST subset(size_t begin, size_t end) const
+	{
+		if (begin >= end || end > _count) throw std::out_of_range("invalid subset");
+		MappedMNIST subset = *this;
+		subset._images = _images.narrow(0, static_cast<int64_t>(begin), static_cast<int64_t>(end - begin));
+		subset._labels = _labels.narrow(0, static_cast<int64_t>(begin), static_cast<int64_t>(end - begin));
+		subset._count = end - begin;
+		return subset;
+	}
+
+	double mean() const { return _mean; }
+	double standard_deviation() const { return _standard_deviation; }
+
+	/// the normalized values of pixel intensities 0 and 1, the bounds attacks must clamp perturbed images to
+	std::pair<double, double> input_range() const
+	{
+		return std::make_pair((0 - _mean) / _standard_deviation, (1 - _mean) / _standard_deviation);
+	}
+
+	/// whether a batch from get_batch views the mapping (consecutive indices) rather than owning a gathered copy
+	bool is_view(const torch::data::Example<>& batch) const
+	{
+		return batch.data.is_alias_of(_images) || batch.target.is_alias_of(_labels);
+	}
+
+private:
+	struct StoreHeader
+	{
+		char magic[8];
+		uint32_t version;
+		int32_t channels;
+		int32_t rows;
+		int32_t columns;
+		uint64_t count;
+		double mean;
+		double standard_deviation;
+		uint64_t images_offset;
+		uint64_t labels_offset;
+	};
+
+	static constexpr const char* kMagic = "YOPOMNST";
+	static constexpr uint32_t kVersion = 1;
+	static constexpr uint64_t kAlignment = 64;
+
+	static uint64_t align(uint64_t offset) { return (offset + kAlignment - 1) / kAlignment * kAlignment; }
+
+	static bool is_valid_store(const std::string& path, double mean, double standard_deviation)
+	{
+		std::ifstream in(path, std::ios::binary | std::ios::ate);
+		if (!in) return false;
+		uint64_t file_size = static_cast<uint64_t>(in.tellg());
+		if (file_size < sizeof(StoreHeader)) return false;
+
+		StoreHeader header;
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+		return in &&
+			std::memcmp(header.magic, kMagic, sizeof(header.magic)) == 0 &&
+			header.version == kVersion &&
+			header.mean == mean &&
+			header.standard_deviation == standard_deviation &&
+			file_size == header.labels_offset + header.count * sizeof(int64_t);
+	}
+
+	static void write_store(
+		const std::string& root,
+		torch::data::datasets::MNIST::Mode mode,
+		const std::string& path,
+		double mean,
+		double standard_deviation)
+	{
+		torch::data::datasets::MNIST mnist(root, mode);
+		auto images = mnist.images().to(torch::kFloat32).sub(mean).div_(standard_deviation).contiguous();
+		auto labels = mnist.targets().to(torch::kInt64).contiguous();
+		if (images.dim() != 4) throw std::runtime_error("unexpected MNIST image layout");
+
+		StoreHeader header;
+		std::memcpy(header.magic, kMagic, sizeof(header.magic));
+		header.version = kVersion;
+		header.channels = static_cast<int32_t>(images.size(1));
+		header.rows = static_cast<int32_t>(images.size(2));
+		header.columns = static_cast<int32_t>(images.size(3));
+		header.count = static_cast<uint64_t>(images.size(0));
+		header.mean = mean;
+		header.standard_deviation = standard_deviation;
+		header.images_offset = align(sizeof(StoreHeader));
+		header.labels_offset = align(header.images_offset + images.numel() * sizeof(float));
+
+		// write next to the destination and rename, so a partially written store is never picked up; the name is
+		// unique to this process so that processes building the same store at once never share a temporary file
+		auto temporary = path + "." + std::to_string(process_id()) + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			if (!out) throw std::runtime_error("unable to create " + temporary);
+			std::vector<char> padding(kAlignment, 0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(padding.data(), header.images_offset - sizeof(header));
+			out.write(reinterpret_cast<const char*>(images.data_ptr<float>()), images.numel() * sizeof(float));
+			out.write(padding.data(), header.labels_offset - (header.images_offset + images.numel() * sizeof(float)));
+			out.write(reinterpret_cast<const char*>(labels.data_ptr<int64_t>()), labels.numel() * sizeof(int64_t));
+			if (!out) throw std::runtime_error("unable to write " + temporary);
+		}
+		// rename replaces the destination on POSIX; Windows needs it removed first and refuses while it is mapped
+		if (std::rename(temporary.c_str(), path.c_str()) == 0) return;
+		std::remove(path.c_str());
+		if (std::rename(temporary.c_str(), path.c_str()) == 0) return;
+		std::remove(temporary.c_str());
+		// losing the rename to another process that wrote the same store is fine
+		if (!is_valid_store(path, mean, standard_deviation))
+			throw std::runtime_error("unable to move " + temporary + " to " + path);
+	}
+
+	static long process_id()
+	{
+#ifdef _WIN32
+		return static_cast<long>(GetCurrentProcessId());
+#else
+		return static_cast<long>(getpid());
+#endif
+	}
+
+	torch::Tensor _images;
+	torch::Tensor _labels;
+	size_t _count = 0;
+	double _mean = 0;
+	double _standard_deviation = 1;
+};
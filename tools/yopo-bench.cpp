@@ -0,0 +1,499 @@
+// yopo-bench.cpp : Measures trainer, attacker and evaluator throughput on synthetic MNIST-shaped batches.
+//
+// Usage: yopo-bench [--batch-size=100] [--batches=20] [--warmup=3] [--device=cpu|cuda]
+//                   [--yopo=5x3,3x5,10x2] [--cases=name,...] [--format=json|csv] [--output=file]
+//                   [--profile=trace.json] [--micro-batch-size=0]
+//
+// Cases ending in -bf16 run in bfloat16 mixed precision; the bf16-parity case compares them with fp32.
+// Cases ending in -channels-last keep inputs, perturbations, weights and activations in NHWC layout.
+// --micro-batch-size splits every training batch into chunks of that size; compare peak_resident_bytes.
+//
+#include <torch/torch.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "SmallCNN.h"
+#include "SmallCNNInference.h"
+#include "Attackers/IAttacker.h"
+#include "Attackers/NoopAttacker.h"
+#include "Attackers/PGDAttacker.h"
+#include "Evaluator.h"
+#include "Loss.h"
+#include "MixedPrecision.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
+#include "Trainers/StandardTrainer.h"
+#include "Trainers/YOPOTrainer.h"
+#include "Trainers/FreeAdversarialTrainer.h"
+#include "Trainers/FastFGSMTrainer.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace nn = torch::nn;
+
+struct BenchmarkOptions
+{
+	int64_t batch_size = 100;
+	int batches = 20;
+	int warmup = 3;
+	c10::Device device = c10::kCPU;
+	std::vector<std::pair<int, int>> yopo_settings = { { 5, 3 }, { 3, 5 }, { 10, 2 } };
+	std::vector<std::string> cases;
+	std::string format = "json";
+	std::string output;
+	std::string profile;
+	int64_t micro_batch_size = 0;
+};
+
+struct BenchmarkResult
+{
+	std::string name;
+	int64_t batch_size;
+	int batches;
+	double images_per_second;
+	double mean_ms;
+	double p50_ms;
+	double p90_ms;
+	double p99_ms;
+	size_t peak_resident_bytes;
+};
+
+/// peak resident set size of the process so far; it never decreases, so cases should be run from cheapest to dearest
+size_t peak_resident_bytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return static_cast<size_t>(usage.ru_maxrss);
+#else
+	return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+/// waits for queued device work; a host copy on the default stream completes after everything queued before it
+void synchronize(const c10::Device& device)
+{
+	if (device.is_cuda())
+		torch::zeros({ 1 }, device).cpu();
+}
+
+double percentile(std::vector<double> sorted, double fraction)
+{
+	if (sorted.empty()) return 0;
+	size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+std::vector<torch::data::Example<>> make_synthetic_batches(
+	const BenchmarkOptions& options,
+	int count,
+	c10::MemoryFormat format = c10::MemoryFormat::Contiguous)
+{
+	std::vector<torch::data::Example<>> batches;
+	for (int i = 0; i < count; ++i)
+	{
+		batches.emplace_back(
+			torch::rand({ options.batch_size, 1, 28, 28 }).to(options.device).contiguous(format),
+			torch::randint(0, 10, { options.batch_size }, torch::kLong).to(options.device));
+	}
+	return batches;
+}
+
+/// <summary>
+/// Times body on synthetic batches. With label set, the batches' random targets are replaced by label(data) before
+/// timing, e.g. by a network's own predictions so that an attack starts from correctly classified samples.
+/// </summary>
+BenchmarkResult run_case(
+	const std::string& name,
+	const BenchmarkOptions& options,
+	const std::function<void(torch::data::Example<>&)>& body,
+	c10::MemoryFormat format = c10::MemoryFormat::Contiguous,
+	const std::function<torch::Tensor(const torch::Tensor&)>& label = nullptr)
+{
+	auto batches = make_synthetic_batches(options, std::min(options.batches, 8), format);
+	if (label)
+		for (auto& batch : batches)
+			batch.target = label(batch.data);
+	for (int i = 0; i < options.warmup; ++i)
+		body(batches[i % batches.size()]);
+	synchronize(options.device);
+
+	std::vector<double> latencies;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < options.batches; ++i)
+	{
+		auto batch_start = std::chrono::steady_clock::now();
+		body(batches[i % batches.size()]);
+		synchronize(options.device);
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batch_start).count());
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::sort(latencies.begin(), latencies.end());
+
+	BenchmarkResult result;
+	result.name = name;
+	result.batch_size = options.batch_size;
+	result.batches = options.batches;
+	result.images_per_second = options.batch_size * options.batches / seconds;
+	result.mean_ms = seconds * 1000.0 / options.batches;
+	result.p50_ms = percentile(latencies, 0.50);
+	result.p90_ms = percentile(latencies, 0.90);
+	result.p99_ms = percentile(latencies, 0.99);
+	result.peak_resident_bytes = peak_resident_bytes();
+	std::cerr << name << ": " << result.images_per_second << " images/s, p50 " << result.p50_ms << " ms" << std::endl;
+	return result;
+}
+
+/// <summary>
+/// A few clean training steps on synthetic batches. SmallCNN's classifier starts at zero, so a fresh network has
+/// all-zero logits and every input gradient vanishes; attack and evaluation cases would time zero-sized steps.
+/// </summary>
+void warm_up(SmallCNN network, const BenchmarkOptions& options)
+{
+	StandardTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl> warmup(network, std::make_shared<NoopAttacker<SmallCNNImpl>>(),
+		std::make_shared<torch::optim::Adam>(network->parameters()), nn::CrossEntropyLoss(), options.device);
+	for (auto& batch : make_synthetic_batches(options, std::min(options.batches, 8)))
+		warmup.train_batch(batch);
+}
+
+/// <summary>
+/// Compares bf16 mixed precision with fp32 from the same starting point. For the attack, the fp32 network's own
+/// predictions serve as labels, so robust accuracy is the share of samples whose prediction survives the attack.
+/// For training, two copies of one network take the same PGD training steps and are compared on a probe batch.
+/// </summary>
+void report_bf16_parity(const BenchmarkOptions& options, double epsilon, double sigma, int iterations)
+{
+	auto device = options.device;
+	SmallCNN network; network->to(device);
+	auto batches = make_synthetic_batches(options, std::min(options.batches, 8));
+	auto probe = batches.front().data;
+
+	warm_up(network, options);
+
+	// attack parity
+	network->eval();
+	torch::Tensor labels;
+	{ torch::NoGradGuard _nogradguard; labels = network(probe).argmax(1); }
+	auto robust_accuracy = [&](ComputePrecision precision) {
+		torch::manual_seed(1);
+		PGDAttacker<SmallCNNImpl> attacker(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, false, precision);
+		auto adversarial_input = attacker(network, probe, labels);
+		torch::NoGradGuard _nogradguard;
+		return network(adversarial_input).argmax(1).eq(labels).to(torch::kDouble).mean().item<double>() * 100;
+	};
+	double fp32_robust = robust_accuracy(ComputePrecision::FP32);
+	double bf16_robust = robust_accuracy(ComputePrecision::BF16);
+	std::cerr << "bf16-parity: PGD-" << iterations << " robust accuracy fp32 " << fp32_robust << "%, bf16 " << bf16_robust << "%" << std::endl;
+
+	// training parity
+	auto train = [&](ComputePrecision precision) {
+		SmallCNN copy(std::dynamic_pointer_cast<SmallCNNImpl>(network->clone(device)));
+		copy->train();
+		auto attacker = std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, false, precision);
+		StandardTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl> trainer(
+			copy, attacker, std::make_shared<torch::optim::Adam>(copy->parameters()), nn::CrossEntropyLoss(), device, precision);
+		torch::manual_seed(2);
+		for (int i = 0; i < options.batches; ++i)
+			trainer.train_batch(batches[i % batches.size()]);
+		copy->eval();
+		torch::NoGradGuard _nogradguard;
+		return copy(probe);
+	};
+	auto fp32_logits = train(ComputePrecision::FP32);
+	auto bf16_logits = train(ComputePrecision::BF16);
+	double agreement = fp32_logits.argmax(1).eq(bf16_logits.argmax(1)).to(torch::kDouble).mean().item<double>() * 100;
+	std::cerr << "bf16-parity: after " << options.batches << " PGD training steps, predictions agree on " << agreement
+		<< "% of the probe batch, max |logit difference| " << (fp32_logits - bf16_logits).abs().max().item<double>() << std::endl;
+}
+
+std::string format_results(const std::vector<BenchmarkResult>& results, const std::string& format)
+{
+	std::ostringstream out;
+	if (format == "csv")
+	{
+		out << "name,batch_size,batches,images_per_second,mean_ms,p50_ms,p90_ms,p99_ms,peak_resident_bytes\n";
+		for (auto& r : results)
+			out << r.name << "," << r.batch_size << "," << r.batches << "," << r.images_per_second << "," << r.mean_ms << ","
+				<< r.p50_ms << "," << r.p90_ms << "," << r.p99_ms << "," << r.peak_resident_bytes << "\n";
+		return out.str();
+	}
+
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		auto& r = results[i];
+		out << "  {\"name\": \"" << r.name << "\", \"batch_size\": " << r.batch_size << ", \"batches\": " << r.batches
+			<< ", \"images_per_second\": " << r.images_per_second << ", \"mean_ms\": " << r.mean_ms
+			<< ", \"p50_ms\": " << r.p50_ms << ", \"p90_ms\": " << r.p90_ms << ", \"p99_ms\": " << r.p99_ms
+			<< ", \"peak_resident_bytes\": " << r.peak_resident_bytes << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "]\n";
+	return out.str();
+}
+
+std::vector<std::string> split(const std::string& value, char separator)
+{
+	std::vector<std::string> parts;
+	std::stringstream stream(value);
+	std::string part;
+	while (std::getline(stream, part, separator))
+		if (!part.empty()) parts.push_back(part);
+	return parts;
+}
+
+BenchmarkOptions parse_options(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		auto separator = argument.find('=');
+		if (argument.rfind("--", 0) != 0 || separator == std::string::npos)
+			throw std::invalid_argument("arguments must look like --name=value: " + argument);
+		auto name = argument.substr(2, separator - 2);
+		auto value = argument.substr(separator + 1);
+
+		if (name == "batch-size") options.batch_size = std::stoll(value);
+		else if (name == "batches") options.batches = std::stoi(value);
+		else if (name == "warmup") options.warmup = std::stoi(value);
+		else if (name == "device") options.device = c10::Device(value);
+		else if (name == "cases") options.cases = split(value, ',');
+		else if (name == "format") options.format = value;
+		else if (name == "output") options.output = value;
+		else if (name == "profile") options.profile = value;
+		else if (name == "micro-batch-size") options.micro_batch_size = std::stoll(value);
+		else if (name == "yopo")
+		{
+			options.yopo_settings.clear();
+			for (auto& setting : split(value, ','))
+			{
+				auto x = setting.find('x');
+				if (x == std::string::npos) throw std::invalid_argument("YOPO settings look like KxN2: " + setting);
+				options.yopo_settings.emplace_back(std::stoi(setting.substr(0, x)), std::stoi(setting.substr(x + 1)));
+			}
+		}
+		else throw std::invalid_argument("unknown argument --" + name);
+	}
+	if (options.batch_size < 1 || options.batches < 1 || options.warmup < 0)
+		throw std::invalid_argument("batch size and batch count must be positive");
+	return options;
+}
+
+int main(int argc, char* argv[])
+{
+	using AttackerPtr = std::shared_ptr<IAttacker<SmallCNNImpl>>;
+
+	auto options = parse_options(argc, argv);
+	torch::manual_seed(0);
+	if (!options.profile.empty())
+	{
+		Profiler::instance().enable();
+		ModuleProfiler::instance().enable();
+	}
+
+	const double epsilon = 6.0 / 255.0;
+	const double sigma = 3.0 / 255.0;
+	const int iterations = 20;
+	auto device = options.device;
+
+	auto selected = [&](const std::string& name) {
+		return options.cases.empty() || std::find(options.cases.begin(), options.cases.end(), name) != options.cases.end();
+	};
+	auto make_network = [&](c10::MemoryFormat format = c10::MemoryFormat::Contiguous) {
+		SmallCNN network;
+		network->to(device);
+		network->set_memory_format(format);
+		return network;
+	};
+	// attack and evaluation cases run on a warmed-up network and label every batch with its own predictions, so
+	// that the attacks take real steps and early stopping drops samples only when they are actually broken
+	auto make_attacked_network = [&](c10::MemoryFormat format = c10::MemoryFormat::Contiguous) {
+		auto network = make_network(format);
+		warm_up(network, options);
+		network->eval();
+		return network;
+	};
+	auto predictions_of = [](SmallCNN network) {
+		return [network](const torch::Tensor& data) mutable {
+			torch::NoGradGuard _nogradguard;
+			return network(data).argmax(1);
+		};
+	};
+
+	std::vector<BenchmarkResult> results;
+
+	// inference only: the eager module against its frozen snapshots
+	{
+		auto network = make_network();
+		network->eval();
+		auto probe = torch::rand({ options.batch_size, 1, 28, 28 }).to(device);
+		torch::Tensor reference;
+		{ torch::NoGradGuard _nogradguard; reference = network(probe); }
+
+		if (selected("inference-eager"))
+		{
+			results.push_back(run_case("inference-eager", options, [&](torch::data::Example<>& batch) {
+				torch::NoGradGuard _nogradguard;
+				network(batch.data);
+			}));
+		}
+
+		if (selected("inference-channels-last"))
+		{
+			auto channels_last = make_network(c10::MemoryFormat::ChannelsLast);
+			channels_last->eval();
+			results.push_back(run_case("inference-channels-last", options, [&](torch::data::Example<>& batch) {
+				torch::NoGradGuard _nogradguard;
+				channels_last(batch.data);
+			}, c10::MemoryFormat::ChannelsLast));
+		}
+
+		std::vector<std::pair<std::string, InferenceBackend>> backends = { { "inference-frozen", InferenceBackend::Dense } };
+		if (device.is_cpu() && at::hasMKLDNN()) backends.push_back({ "inference-mkldnn", InferenceBackend::MKLDNN });
+		for (auto& entry : backends)
+		{
+			if (!selected(entry.first)) continue;
+			SmallCNNInference frozen(network, entry.second);
+			std::cerr << entry.first << ": max |logit difference| to eager "
+				<< (frozen(probe) - reference).abs().max().item<double>() << std::endl;
+			results.push_back(run_case(entry.first, options, [&](torch::data::Example<>& batch) { frozen(batch.data); }));
+		}
+	}
+
+	// attack generation alone
+	std::vector<std::pair<std::string, AttackerPtr>> attackers = {
+		{ "pgd20-reference", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::Reference) },
+		{ "pgd20-inplace", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace) },
+		{ "pgd20-early-stop", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, true) },
+		{ "pgd20-bf16", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, false, ComputePrecision::BF16) },
+	};
+	for (auto& entry : attackers)
+	{
+		if (!selected(entry.first)) continue;
+		auto network = make_attacked_network();
+		auto attacker = entry.second;
+		results.push_back(run_case(entry.first, options, [&](torch::data::Example<>& batch) {
+			(*attacker)(network, batch.data, batch.target);
+		}, c10::MemoryFormat::Contiguous, predictions_of(network)));
+	}
+
+	if (selected("pgd20-channels-last"))
+	{
+		auto network = make_attacked_network(c10::MemoryFormat::ChannelsLast);
+		PGDAttacker<SmallCNNImpl> attacker(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace);
+		results.push_back(run_case("pgd20-channels-last", options, [&](torch::data::Example<>& batch) {
+			attacker(network, batch.data, batch.target);
+		}, c10::MemoryFormat::ChannelsLast, predictions_of(network)));
+	}
+
+	if (selected("evaluator-pgd20"))
+	{
+		auto network = make_attacked_network();
+		Evaluator<SmallCNNImpl> evaluator(
+			std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, true), device);
+		results.push_back(run_case("evaluator-pgd20", options, [&](torch::data::Example<>& batch) {
+			evaluator.evaluate_single_batch(network, batch);
+		}, c10::MemoryFormat::Contiguous, predictions_of(network)));
+	}
+
+	// full training steps
+	struct StandardCase { std::string name; AttackerPtr attacker; ComputePrecision precision; c10::MemoryFormat format; };
+	auto contiguous = c10::MemoryFormat::Contiguous;
+	std::vector<StandardCase> standard = {
+		{ "standard-clean", std::make_shared<NoopAttacker<SmallCNNImpl>>(), ComputePrecision::FP32, contiguous },
+		{ "standard-pgd20", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace),
+			ComputePrecision::FP32, contiguous },
+		{ "standard-pgd20-bf16", std::make_shared<PGDAttacker<SmallCNNImpl>>(
+			epsilon, sigma, iterations, device, PGDExecutionMode::InPlace, false, ComputePrecision::BF16), ComputePrecision::BF16, contiguous },
+		{ "standard-pgd20-channels-last", std::make_shared<PGDAttacker<SmallCNNImpl>>(epsilon, sigma, iterations, device, PGDExecutionMode::InPlace),
+			ComputePrecision::FP32, c10::MemoryFormat::ChannelsLast },
+	};
+	for (auto& entry : standard)
+	{
+		if (!selected(entry.name)) continue;
+		auto network = make_network(entry.format);
+		auto trainer = std::make_shared<StandardTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
+			network, entry.attacker, std::make_shared<torch::optim::Adam>(network->parameters()), nn::CrossEntropyLoss(), device,
+			entry.precision);
+		trainer->set_micro_batch_size(options.micro_batch_size);
+		results.push_back(run_case(entry.name, options, [&](torch::data::Example<>& batch) { trainer->train_batch(batch); }, entry.format));
+	}
+
+	for (auto& setting : options.yopo_settings)
+	{
+		struct Variant { std::string suffix; ComputePrecision precision; c10::MemoryFormat format; };
+		for (auto& variant : { Variant{ "", ComputePrecision::FP32, contiguous }, Variant{ "-bf16", ComputePrecision::BF16, contiguous },
+			Variant{ "-channels-last", ComputePrecision::FP32, c10::MemoryFormat::ChannelsLast } })
+		{
+			auto name = "yopo-" + std::to_string(setting.first) + "-" + std::to_string(setting.second) + variant.suffix;
+			if (!selected(name)) continue;
+			auto network = make_network(variant.format);
+			auto trainer = std::make_shared<YOPOTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
+				network, std::make_shared<torch::optim::Adam>(network->parameters()), nn::CrossEntropyLoss(),
+				setting.first, setting.second, sigma, epsilon, device, variant.precision);
+			trainer->set_micro_batch_size(options.micro_batch_size);
+			results.push_back(run_case(name, options, [&](torch::data::Example<>& batch) { trainer->train_batch(batch); }, variant.format));
+		}
+	}
+
+	if (selected("free-8"))
+	{
+		auto network = make_network();
+		FreeAdversarialTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl> trainer(
+			network, std::make_shared<torch::optim::Adam>(network->parameters()), nn::CrossEntropyLoss(), 8, epsilon, device);
+		results.push_back(run_case("free-8", options, [&](torch::data::Example<>& batch) { trainer.train_batch(batch); }));
+	}
+
+	if (selected("fast-fgsm"))
+	{
+		auto network = make_network();
+		FastFGSMTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl> trainer(
+			network, std::make_shared<torch::optim::Adam>(network->parameters()), nn::CrossEntropyLoss(), epsilon, device);
+		results.push_back(run_case("fast-fgsm", options, [&](torch::data::Example<>& batch) { trainer.train_batch(batch); }));
+	}
+
+	if (selected("bf16-parity"))
+		report_bf16_parity(options, epsilon, sigma, iterations);
+
+	auto report = format_results(results, options.format);
+	if (options.output.empty())
+	{
+		std::cout << report;
+	}
+	else
+	{
+		std::ofstream out(options.output);
+		out << report;
+	}
+
+	if (!options.profile.empty())
+	{
+		Profiler::instance().write_chrome_trace(options.profile);
+		std::cerr << Profiler::instance().summary();
+		std::cerr << ModuleProfiler::instance().summary();
+	}
+	return 0;
+}
@@ -0,0 +1,105 @@
+// yopo-evaluate.cpp : Worst-case robust accuracy of a trained SmallCNN over an ensemble of attacks: PGD with
+// cross-entropy, PGD with the Carlini-Wagner margin and APGD, each with optional random restarts. A test sample counts
+// as robust only if every attack fails on it; each attack only runs on the samples the earlier ones left standing.
+//
+// Usage: yopo-evaluate --model=PGD-Adversarial-1.pt [--data=D:/Projects/data/mnist] [--batch-size=100] [--workers=4]
+//                      [--pgd-iterations=20] [--apgd-iterations=100] [--restarts=1] [--min-robust-accuracy=0]
+//
+// Exits with 1 when the worst-case robust accuracy is below --min-robust-accuracy (in percent), so that it can gate
+// a release.
+//
+#include <torch/torch.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include "SmallCNN.h"
+#include "datasets.h"
+#include "Attackers/IAttacker.h"
+#include "Attackers/PGDAttacker.h"
+#include "Attackers/APGDAttacker.h"
+#include "EnsembleEvaluator.h"
+#include "ParallelEvaluator.h"
+
+namespace dt = torch::data;
+
+struct EvaluateOptions
+{
+	std::string model;
+	std::string data = "D:/Projects/data/mnist";
+	int batch_size = 100;
+	int workers = 4;
+	int pgd_iterations = 20;
+	int apgd_iterations = 100;
+	int restarts = 1;
+	double min_robust_accuracy = 0;
+};
+
+EvaluateOptions parse_options(int argc, char* argv[])
+{
+	EvaluateOptions options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		auto separator = argument.find('=');
+		if (argument.rfind("--", 0) != 0 || separator == std::string::npos)
+			throw std::invalid_argument("arguments must look like --name=value: " + argument);
+		auto name = argument.substr(2, separator - 2);
+		auto value = argument.substr(separator + 1);
+
+		if (name == "model") options.model = value;
+		else if (name == "data") options.data = value;
+		else if (name == "batch-size") options.batch_size = std::stoi(value);
+		else if (name == "workers") options.workers = std::stoi(value);
+		else if (name == "pgd-iterations") options.pgd_iterations = std::stoi(value);
+		else if (name == "apgd-iterations") options.apgd_iterations = std::stoi(value);
+		else if (name == "restarts") options.restarts = std::stoi(value);
+		else if (name == "min-robust-accuracy") options.min_robust_accuracy = std::stod(value);
+		else throw std::invalid_argument("unknown argument --" + name);
+	}
+	if (options.model.empty()) throw std::invalid_argument("--model is required");
+	if (options.batch_size < 1 || options.workers < 1 || options.pgd_iterations < 1 || options.apgd_iterations < 1 ||
+		options.restarts < 1)
+		throw std::invalid_argument("sizes, iterations and restarts must be positive");
+	return options;
+}
+
+/// cheapest first: PGD-CE with early stopping removes most breakable samples before CW and APGD run; inputRange holds
+/// the normalized bounds of valid images
+EnsembleEvaluator<SmallCNNImpl> make_ensemble(const EvaluateOptions& options, std::pair<double, double> inputRange)
+{
+	const double epsilon = 6.0 / 255.0, sigma = 3.0 / 255.0;
+	auto pgd_ce = std::make_shared<PGDAttacker<SmallCNNImpl>>(
+		epsilon, sigma, options.pgd_iterations, c10::kCPU, PGDExecutionMode::InPlace, /*early_stopping*/ true);
+	pgd_ce->set_restarts(options.restarts);
+	pgd_ce->set_input_range(inputRange.first, inputRange.second);
+	auto pgd_cw = std::make_shared<PGDAttacker<SmallCNNImpl>>(
+		epsilon, sigma, options.pgd_iterations, c10::kCPU, PGDExecutionMode::InPlace);
+	pgd_cw->set_loss(AttackLoss::CWMargin);
+	pgd_cw->set_restarts(options.restarts);
+	pgd_cw->set_input_range(inputRange.first, inputRange.second);
+	auto apgd_ce = std::make_shared<APGDAttacker<SmallCNNImpl>>(
+		epsilon, options.apgd_iterations, c10::kCPU, AttackLoss::CrossEntropy, options.restarts);
+	apgd_ce->set_input_range(inputRange.first, inputRange.second);
+	return EnsembleEvaluator<SmallCNNImpl>({ pgd_ce, pgd_cw, apgd_ce }, c10::kCPU);
+}
+
+int main(int argc, char* argv[])
+{
+	auto options = parse_options(argc, argv);
+	torch::manual_seed(0);
+
+	SmallCNN network;
+	torch::load(network, options.model);
+	network->to(c10::kCPU);
+	network->eval();
+
+	auto test = MappedMNIST(options.data, dt::datasets::MNIST::Mode::kTest, options.data + "/test.yopo-store");
+	ParallelEvaluator<SmallCNNImpl, MappedMNIST, EnsembleEvaluator<SmallCNNImpl>> evaluator(
+		test, [&]() { return make_ensemble(options, test.input_range()); }, options.workers, options.batch_size, c10::kCPU);
+	auto ensemble = evaluator.evaluate_all(network);
+
+	std::cout << "worst case over " << ensemble._attackers.size() << " attacks at eps 6/255\n";
+	ensemble.report(std::cout);
+	return ensemble.get_accuracies().second < options.min_robust_accuracy ? 1 : 0;
+}
@@ -0,0 +1,187 @@
+// yopo-quantize.cpp : Quantizes a trained SmallCNN to int8 and compares it with the float model on clean accuracy,
+// PGD robust accuracy, CPU latency and weight memory.
+//
+// Usage: yopo-quantize --model=PGD-Adversarial-1.pt [--data=D:/Projects/data/mnist] [--calibration-batches=10]
+//                      [--test-samples=10000] [--batch-size=100] [--pgd-iterations=20] [--attack-cache=dir]
+//                      [--transfer=1]
+//
+// --attack-cache keeps PGD examples on disk so that re-scoring the same model skips the attack. --transfer scores
+// the int8 model on the float model's adversarial examples instead of attacking it directly.
+//
+#include <torch/torch.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "SmallCNN.h"
+#include "QuantizedSmallCNN.h"
+#include "datasets.h"
+#include "Attackers/IAttacker.h"
+#include "Attackers/PGDAttacker.h"
+#include "Attackers/CachedAttacker.h"
+#include "Evaluator.h"
+
+namespace dt = torch::data;
+
+struct QuantizeOptions
+{
+	std::string model;
+	std::string data = "D:/Projects/data/mnist";
+	int calibration_batches = 10;
+	int64_t test_samples = 10000;
+	int64_t batch_size = 100;
+	int pgd_iterations = 20;
+	std::string attack_cache;
+	bool transfer = false;
+};
+
+QuantizeOptions parse_options(int argc, char* argv[])
+{
+	QuantizeOptions options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		auto separator = argument.find('=');
+		if (argument.rfind("--", 0) != 0 || separator == std::string::npos)
+			throw std::invalid_argument("arguments must look like --name=value: " + argument);
+		auto name = argument.substr(2, separator - 2);
+		auto value = argument.substr(separator + 1);
+
+		if (name == "model") options.model = value;
+		else if (name == "data") options.data = value;
+		else if (name == "calibration-batches") options.calibration_batches = std::stoi(value);
+		else if (name == "test-samples") options.test_samples = std::stoll(value);
+		else if (name == "batch-size") options.batch_size = std::stoll(value);
+		else if (name == "pgd-iterations") options.pgd_iterations = std::stoi(value);
+		else if (name == "attack-cache") options.attack_cache = value;
+		else if (name == "transfer") options.transfer = value != "0" && value != "false";
+		else throw std::invalid_argument("unknown argument --" + name);
+	}
+	if (options.model.empty()) throw std::invalid_argument("--model is required");
+	if (options.calibration_batches < 1 || options.test_samples < 1 || options.batch_size < 1)
+		throw std::invalid_argument("batch counts and sizes must be positive");
+	return options;
+}
+
+/// attacks the source network and hands its adversarial examples to the network being evaluated
+template <typename TargetType, typename SourceType>
+struct TransferAttacker : IAttacker<TargetType>
+{
+	TransferAttacker(torch::nn::ModuleHolder<SourceType> source, std::shared_ptr<IAttacker<SourceType>> attacker) :
+		_source(source), _attacker(attacker)
+	{}
+
+	virtual torch::Tensor operator()(nn::ModuleHolder<TargetType> network, torch::Tensor input, torch::Tensor labels)
+	{
+		return (*_attacker)(_source, input, labels);
+	}
+
+	void to_device(c10::Device& device) { _attacker->to_device(device); }
+	virtual AttackType getType() { return _attacker->getType(); }
+	virtual std::string getDescription() { return "transfer " + _attacker->getDescription(); }
+
+	torch::nn::ModuleHolder<SourceType> _source;
+	std::shared_ptr<IAttacker<SourceType>> _attacker;
+};
+
+/// PGD on the network itself, clamped to inputRange and behind the on-disk cache when --attack-cache is given
+template <typename NetworkType>
+std::shared_ptr<IAttacker<NetworkType>> make_attacker(const QuantizeOptions& options, std::pair<double, double> inputRange)
+{
+	auto pgd = std::make_shared<PGDAttacker<NetworkType>>(
+		6.0 / 255.0, 3.0 / 255.0, options.pgd_iterations, c10::kCPU, PGDExecutionMode::InPlace);
+	pgd->set_input_range(inputRange.first, inputRange.second);
+	std::shared_ptr<IAttacker<NetworkType>> attacker = pgd;
+	if (!options.attack_cache.empty())
+		attacker = std::make_shared<CachedAttacker<NetworkType>>(attacker, options.attack_cache);
+	return attacker;
+}
+
+/// clean and PGD accuracy over the first samples of the test set
+template <typename NetworkType>
+std::pair<double, double> evaluate(
+	torch::nn::ModuleHolder<NetworkType> network,
+	std::shared_ptr<IAttacker<NetworkType>> attacker,
+	MappedMNIST& test,
+	const QuantizeOptions& options)
+{
+	network->eval();
+	Evaluator<NetworkType> evaluator(attacker, c10::kCPU);
+	int64_t samples = std::min<int64_t>(options.test_samples, test.size().value());
+	for (int64_t first = 0; first < samples; first += options.batch_size)
+	{
+		auto count = std::min(options.batch_size, samples - first);
+		torch::data::Example<> batch(test.images().narrow(0, first, count), test.targets().narrow(0, first, count));
+		evaluator.evaluate_single_batch(network, batch);
+	}
+	return evaluator.get_accuracies();
+}
+
+/// median milliseconds per batch of inference without autograd
+double median_latency_ms(const std::function<void(const torch::Tensor&)>& forward, const torch::Tensor& batch)
+{
+	torch::NoGradGuard _nogradguard;
+	for (int i = 0; i < 3; ++i) forward(batch);
+	std::vector<double> latencies;
+	for (int i = 0; i < 20; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		forward(batch);
+		latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	std::sort(latencies.begin(), latencies.end());
+	return latencies[latencies.size() / 2];
+}
+
+int main(int argc, char* argv[])
+{
+	auto options = parse_options(argc, argv);
+	torch::manual_seed(0);
+
+	SmallCNN network;
+	torch::load(network, options.model);
+	network->to(c10::kCPU);
+	network->eval();
+
+	auto training = MappedMNIST(options.data, dt::datasets::MNIST::Mode::kTrain, options.data + "/train.yopo-store");
+	auto test = MappedMNIST(options.data, dt::datasets::MNIST::Mode::kTest, options.data + "/test.yopo-store");
+
+	// calibrate on a random sample of the training set
+	std::vector<torch::Tensor> calibration;
+	auto order = torch::randperm(static_cast<int64_t>(training.size().value()), torch::kLong);
+	for (int b = 0; b < options.calibration_batches; ++b)
+		calibration.push_back(training.images().index_select(0, order.narrow(0, b * options.batch_size, options.batch_size)));
+	QuantizedSmallCNN quantized(network, calibration);
+
+	// with --transfer the int8 model meets the float model's examples, replayed from the cache when there is one
+	auto float_attacker = make_attacker<SmallCNNImpl>(options, test.input_range());
+	auto float_accuracies = evaluate(network, float_attacker, test, options);
+	std::shared_ptr<IAttacker<QuantizedSmallCNNImpl>> int8_attacker;
+	if (options.transfer)
+		int8_attacker = std::make_shared<TransferAttacker<QuantizedSmallCNNImpl, SmallCNNImpl>>(network, float_attacker);
+	else
+		int8_attacker = make_attacker<QuantizedSmallCNNImpl>(options, test.input_range());
+	auto int8_accuracies = evaluate(quantized, int8_attacker, test, options);
+
+	auto batch = test.images().narrow(0, 0, std::min<int64_t>(options.batch_size, test.size().value())).clone();
+	double float_ms = median_latency_ms([&](const torch::Tensor& x) { network(x); }, batch);
+	double int8_ms = median_latency_ms([&](const torch::Tensor& x) { quantized(x); }, batch);
+
+	std::cout << "int8 kernels: " << (quantized->uses_fbgemm() ? "FBGEMM" : "simulated (FBGEMM unavailable)") << "\n"
+		<< "calibration: " << options.calibration_batches * options.batch_size << " training images, "
+		<< "evaluation: " << std::min<int64_t>(options.test_samples, test.size().value()) << " test images, PGD-"
+		<< options.pgd_iterations << " at eps 6/255" << (options.transfer ? ", int8 scored on the float model's examples" : "")
+		<< "\n\n"
+		<< std::left << std::setw(8) << "model" << std::right << std::setw(12) << "clean %" << std::setw(12) << "robust %"
+		<< std::setw(16) << "ms / batch" << std::setw(16) << "weight bytes" << "\n"
+		<< std::fixed << std::setprecision(2)
+		<< std::left << std::setw(8) << "float" << std::right << std::setw(12) << float_accuracies.first << std::setw(12)
+		<< float_accuracies.second << std::setw(16) << float_ms << std::setw(16) << quantized->float_weight_bytes() << "\n"
+		<< std::left << std::setw(8) << "int8" << std::right << std::setw(12) << int8_accuracies.first << std::setw(12)
+		<< int8_accuracies.second << std::setw(16) << int8_ms << std::setw(16) << quantized->int8_weight_bytes() << "\n";
+	return 0;
+}
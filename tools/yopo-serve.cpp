@@ -0,0 +1,472 @@
+// yopo-serve.cpp : Serves a trained SmallCNN checkpoint over a local Unix domain socket, batching concurrent requests.
+//
+// Usage: yopo-serve --model=PGD-Adversarial-1.pt [--socket=/tmp/yopo-serve.sock] [--max-batch=64]
+//                   [--max-delay-us=2000] [--workers=2] [--device=cpu|cuda] [--backend=frozen|mkldnn|eager]
+//
+// Protocol (native byte order, every message starts with a uint32 opcode):
+//   1 classify  request: 784 float32 pixels of one 1x28x28 image, normalized like the training data
+//               reply:   int32 predicted label followed by 10 float32 logits
+//   2 stats     reply:   uint32 length followed by that many bytes of JSON
+//
+#include <torch/torch.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <functional>
+#include "SmallCNN.h"
+#include "SmallCNNInference.h"
+
+namespace
+{
+	constexpr uint32_t kClassify = 1;
+	constexpr uint32_t kStats = 2;
+	constexpr int kPixels = 28 * 28;
+	constexpr int kLabels = 10;
+
+	using Clock = std::chrono::steady_clock;
+
+	struct ServeOptions
+	{
+		std::string model;
+		std::string socket = "/tmp/yopo-serve.sock";
+		int max_batch = 64;
+		int max_delay_us = 2000;
+		int workers = 2;
+		c10::Device device = c10::kCPU;
+		std::string backend = "frozen";
+	};
+
+	struct Response
+	{
+		int32_t label;
+		std::array<float, kLabels> logits;
+	};
+
+	struct Request
+	{
+		std::array<float, kPixels> pixels;
+		std::promise<Response> response;
+		Clock::time_point received;
+	};
+
+	/// <summary>
+	/// Request counters plus a window of the most recent latencies for percentiles. Latency is measured from the
+	/// moment the request was read off the socket until its reply is ready, so it includes the batching delay.
+	/// </summary>
+	class ServeStatistics
+	{
+	public:
+		ServeStatistics(size_t window = 10000) : _latencies_us(window), _started(Clock::now()) {}
+
+		void record_batch(const std::vector<double>& latencies_us)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_batches += 1;
+			for (double latency : latencies_us)
+				_latencies_us[_requests++ % _latencies_us.size()] = latency;
+		}
+
+		std::string to_json()
+		{
+			std::vector<double> window;
+			uint64_t requests, batches;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				requests = _requests;
+				batches = _batches;
+				window.assign(_latencies_us.begin(), _latencies_us.begin() + std::min<uint64_t>(requests, _latencies_us.size()));
+			}
+			std::sort(window.begin(), window.end());
+			auto percentile = [&](double fraction) {
+				return window.empty() ? 0.0 : window[std::min(window.size() - 1, static_cast<size_t>(fraction * window.size()))];
+			};
+			double seconds = std::chrono::duration<double>(Clock::now() - _started).count();
+
+			std::ostringstream out;
+			out << "{\"requests\": " << requests << ", \"batches\": " << batches
+				<< ", \"mean_batch_size\": " << (batches ? static_cast<double>(requests) / batches : 0.0)
+				<< ", \"requests_per_second\": " << requests / seconds
+				<< ", \"latency_us\": {\"p50\": " << percentile(0.50) << ", \"p90\": " << percentile(0.90)
+				<< ", \"p99\": " << percentile(0.99) << ", \"max\": " << (window.empty() ? 0.0 : window.back())
+				<< ", \"window\": " << window.size() << "}}";
+			return out.str();
+		}
+
+	private:
+		std::mutex _mutex;
+		std::vector<double> _latencies_us;
+		uint64_t _requests = 0;
+		uint64_t _batches = 0;
+		Clock::time_point _started;
+	};
+
+	/// <summary>
+	/// Pool of inference workers sharing one request queue. A worker takes the oldest request and keeps collecting
+	/// until it has max_batch requests or the oldest one has waited max_delay, then runs a single forward pass for
+	/// the whole batch on its own replica of the network.
+	/// </summary>
+	class BatchingPool
+	{
+	public:
+		/// the intra-op thread count is process-wide, so it is split between the workers once, here, before they start
+		BatchingPool(SmallCNN network, const ServeOptions& options, ServeStatistics& statistics) :
+			_options(options), _statistics(statistics)
+		{
+			at::set_num_threads(std::max(1, at::get_num_threads() / options.workers));
+			for (int w = 0; w < options.workers; ++w)
+			{
+				SmallCNN replica(std::dynamic_pointer_cast<SmallCNNImpl>(network->clone(options.device)));
+				replica->eval();
+				_workers.emplace_back([this, replica]() { run_worker(make_model(replica)); });
+			}
+		}
+
+		~BatchingPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_pending.notify_all();
+			for (auto& worker : _workers)
+				worker.join();
+		}
+
+		std::future<Response> submit(std::unique_ptr<Request> request)
+		{
+			auto response = request->response.get_future();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_queue.push_back(std::move(request));
+			}
+			_pending.notify_one();
+			return response;
+		}
+
+	private:
+		/// the frozen snapshots skip the module tree; eager runs the trained module as is
+		std::function<torch::Tensor(torch::Tensor)> make_model(SmallCNN replica)
+		{
+			if (_options.backend == "eager")
+				return [replica](torch::Tensor x) mutable { return replica(x); };
+			auto backend = _options.backend == "mkldnn" ? InferenceBackend::MKLDNN : InferenceBackend::Dense;
+			auto frozen = std::make_shared<SmallCNNInference>(replica, backend);
+			return [frozen](torch::Tensor x) { return frozen->forward(x); };
+		}
+
+		void run_worker(std::function<torch::Tensor(torch::Tensor)> network)
+		{
+			at::init_num_threads();
+			torch::NoGradGuard _nogradguard;
+
+			while (true)
+			{
+				auto batch = next_batch();
+				if (batch.empty()) return;
+
+				auto input = torch::empty({ static_cast<int64_t>(batch.size()), 1, 28, 28 });
+				for (size_t i = 0; i < batch.size(); ++i)
+					std::memcpy(input[i].data_ptr<float>(), batch[i]->pixels.data(), sizeof(float) * kPixels);
+
+				// requests before fulfilled already have their reply; only the rest may receive the exception
+				size_t fulfilled = 0;
+				try
+				{
+					auto logits = network(input.to(_options.device)).to(torch::kCPU).contiguous();
+					auto labels = logits.argmax(1);
+					std::vector<double> latencies_us;
+					for (; fulfilled < batch.size(); ++fulfilled)
+					{
+						Response response;
+						response.label = static_cast<int32_t>(labels[fulfilled].item<int64_t>());
+						std::memcpy(response.logits.data(), logits[fulfilled].data_ptr<float>(), sizeof(float) * kLabels);
+						auto& request = batch[fulfilled];
+						latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - request->received).count());
+						request->response.set_value(response);
+					}
+					_statistics.record_batch(latencies_us);
+				}
+				catch (...)
+				{
+					for (size_t i = fulfilled; i < batch.size(); ++i)
+						batch[i]->response.set_exception(std::current_exception());
+				}
+			}
+		}
+
+		/// blocks for the first request, then until the batch is full or the first request's deadline passes
+		std::vector<std::unique_ptr<Request>> next_batch()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			do
+			{
+				// another worker may take the queued requests while this one waits for the deadline
+				_pending.wait(lock, [&]() { return _stopping || !_queue.empty(); });
+				if (_queue.empty()) return {};
+
+				auto deadline = _queue.front()->received + std::chrono::microseconds(_options.max_delay_us);
+				_pending.wait_until(lock, deadline, [&]() {
+					return _stopping || static_cast<int>(_queue.size()) >= _options.max_batch;
+				});
+			} while (_queue.empty());
+
+			std::vector<std::unique_ptr<Request>> batch;
+			while (!_queue.empty() && static_cast<int>(batch.size()) < _options.max_batch)
+			{
+				batch.push_back(std::move(_queue.front()));
+				_queue.pop_front();
+			}
+			// whatever is left over already has a running deadline; let another worker pick it up
+			if (!_queue.empty()) _pending.notify_one();
+			return batch;
+		}
+
+		const ServeOptions& _options;
+		ServeStatistics& _statistics;
+		std::mutex _mutex;
+		std::condition_variable _pending;
+		std::deque<std::unique_ptr<Request>> _queue;
+		std::vector<std::thread> _workers;
+		bool _stopping = false;
+	};
+
+	bool read_fully(int fd, void* buffer, size_t size)
+	{
+		auto bytes = static_cast<char*>(buffer);
+		while (size > 0)
+		{
+			ssize_t count = ::read(fd, bytes, size);
+			if (count < 0 && errno == EINTR) continue;
+			if (count <= 0) return false;
+			bytes += count;
+			size -= count;
+		}
+		return true;
+	}
+
+	bool write_fully(int fd, const void* buffer, size_t size)
+	{
+		auto bytes = static_cast<const char*>(buffer);
+		while (size > 0)
+		{
+			ssize_t count = ::write(fd, bytes, size);
+			if (count < 0 && errno == EINTR) continue;
+			if (count <= 0) return false;
+			bytes += count;
+			size -= count;
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// Replies of one connection in request order. The reader appends a future per classify request (or the JSON of a
+	/// stats request) and goes on reading, so requests pipelined on a connection reach the pool together and can share
+	/// a batch; the writer sends each reply once it is ready. At most kMaxInFlight replies are outstanding.
+	/// </summary>
+	class ReplyQueue
+	{
+	public:
+		struct Reply
+		{
+			std::future<Response> response;
+			std::string stats;
+		};
+
+		static constexpr size_t kMaxInFlight = 256;
+
+		/// blocks while the queue is full; false once the writer has given up on the connection
+		bool push(Reply reply)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_changed.wait(lock, [&]() { return _closed || _replies.size() < kMaxInFlight; });
+			if (_closed) return false;
+			_replies.push_back(std::move(reply));
+			_changed.notify_all();
+			return true;
+		}
+
+		/// blocks for the next reply; false once the queue is closed and drained
+		bool pop(Reply& reply)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_changed.wait(lock, [&]() { return _closed || _finished || !_replies.empty(); });
+			if (_closed || _replies.empty()) return false;
+			reply = std::move(_replies.front());
+			_replies.pop_front();
+			_changed.notify_all();
+			return true;
+		}
+
+		/// the reader has no more requests; the writer still drains what is queued
+		void finish()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_finished = true;
+			_changed.notify_all();
+		}
+
+		/// the writer failed; queued replies are dropped and the reader stops
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_closed = true;
+			_changed.notify_all();
+		}
+
+	private:
+		std::mutex _mutex;
+		std::condition_variable _changed;
+		std::deque<Reply> _replies;
+		bool _finished = false;
+		bool _closed = false;
+	};
+
+	void write_replies(int fd, ReplyQueue& replies)
+	{
+		ReplyQueue::Reply reply;
+		while (replies.pop(reply))
+		{
+			bool written;
+			if (reply.response.valid())
+			{
+				Response response;
+				try { response = reply.response.get(); }
+				catch (const std::exception& e)
+				{
+					std::cerr << "inference failed: " << e.what() << std::endl;
+					break;
+				}
+				written = write_fully(fd, &response.label, sizeof(response.label)) &&
+					write_fully(fd, response.logits.data(), sizeof(float) * kLabels);
+			}
+			else
+			{
+				uint32_t length = static_cast<uint32_t>(reply.stats.size());
+				written = write_fully(fd, &length, sizeof(length)) && write_fully(fd, reply.stats.data(), reply.stats.size());
+			}
+			if (!written) break;
+		}
+		// wakes a reader blocked on a full queue or on the socket
+		replies.close();
+		::shutdown(fd, SHUT_RDWR);
+	}
+
+	/// serves one client until it disconnects or sends something malformed; requests on a connection are answered in order
+	void serve_connection(int fd, BatchingPool& pool, ServeStatistics& statistics)
+	{
+		ReplyQueue replies;
+		std::thread writer(write_replies, fd, std::ref(replies));
+
+		uint32_t opcode;
+		while (read_fully(fd, &opcode, sizeof(opcode)))
+		{
+			ReplyQueue::Reply reply;
+			if (opcode == kClassify)
+			{
+				auto request = std::make_unique<Request>();
+				if (!read_fully(fd, request->pixels.data(), sizeof(float) * kPixels)) break;
+				request->received = Clock::now();
+				reply.response = pool.submit(std::move(request));
+			}
+			else if (opcode == kStats)
+			{
+				reply.stats = statistics.to_json();
+			}
+			else
+			{
+				std::cerr << "unknown opcode " << opcode << ", closing connection" << std::endl;
+				break;
+			}
+			if (!replies.push(std::move(reply))) break;
+		}
+		replies.finish();
+		writer.join();
+		::close(fd);
+	}
+
+	ServeOptions parse_options(int argc, char* argv[])
+	{
+		ServeOptions options;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string argument = argv[i];
+			auto separator = argument.find('=');
+			if (argument.rfind("--", 0) != 0 || separator == std::string::npos)
+				throw std::invalid_argument("arguments must look like --name=value: " + argument);
+			auto name = argument.substr(2, separator - 2);
+			auto value = argument.substr(separator + 1);
+
+			if (name == "model") options.model = value;
+			else if (name == "socket") options.socket = value;
+			else if (name == "max-batch") options.max_batch = std::stoi(value);
+			else if (name == "max-delay-us") options.max_delay_us = std::stoi(value);
+			else if (name == "workers") options.workers = std::stoi(value);
+			else if (name == "device") options.device = c10::Device(value);
+			else if (name == "backend") options.backend = value;
+			else throw std::invalid_argument("unknown argument --" + name);
+		}
+		if (options.model.empty()) throw std::invalid_argument("--model is required");
+		if (options.backend != "frozen" && options.backend != "mkldnn" && options.backend != "eager")
+			throw std::invalid_argument("unknown backend " + options.backend);
+		if (options.backend == "mkldnn" && !options.device.is_cpu())
+			throw std::invalid_argument("the mkldnn backend only runs on the CPU");
+		if (options.max_batch < 1 || options.max_delay_us < 0 || options.workers < 1)
+			throw std::invalid_argument("batch size and worker count must be positive");
+		if (options.socket.size() >= sizeof(sockaddr_un::sun_path))
+			throw std::invalid_argument("socket path is too long: " + options.socket);
+		return options;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	auto options = parse_options(argc, argv);
+	std::signal(SIGPIPE, SIG_IGN);
+
+	SmallCNN network;
+	torch::load(network, options.model);
+	network->to(options.device);
+	network->eval();
+
+	ServeStatistics statistics;
+	BatchingPool pool(network, options, statistics);
+
+	int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) throw std::runtime_error("unable to create a socket");
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	std::strncpy(address.sun_path, options.socket.c_str(), sizeof(address.sun_path) - 1);
+	::unlink(options.socket.c_str());
+	if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 128) != 0)
+		throw std::runtime_error("unable to listen on " + options.socket);
+
+	std::cerr << "serving " << options.model << " on " << options.socket << " with " << options.workers
+		<< " workers, batches of up to " << options.max_batch << " within " << options.max_delay_us << "us" << std::endl;
+
+	while (true)
+	{
+		int client = ::accept(listener, nullptr, nullptr);
+		if (client < 0)
+		{
+			if (errno == EINTR) continue;
+			throw std::runtime_error("accept failed on " + options.socket);
+		}
+		std::thread(serve_connection, client, std::ref(pool), std::ref(statistics)).detach();
+	}
+}
@@ -3,24 +3,16 @@
 
 double calculate_torch_accuracy(torch::Tensor output, torch::Tensor target)
 {
-	if (output.dim() != 2 || target.dim() != 2 || output.size(0) != target.size(0))
-		throw std::invalid_argument("Incompatible label dimensions");
-	auto batch_size = output.size(0);
+	return count_torch_correct(output, target).item<double>() * 100.0 / output.size(0);
+}
 
-	torch::Tensor predictions;
-	std::tie(std::ignore, predictions) = output.topk(
-		1 /* get top logit value */,
-		1 /* by going along the dimension of logits*/,
-		true /* and take max */,
-		true /* leave default */);
-	assert_equal_content_count(target, predictions);
-	auto target_reshaped = target.view({ 1, -1 }).expand_as(predictions);
-	auto is_correct = predictions.eq_(target_reshaped);
-	auto ans = is_correct.view(-1).sum(0);
-	auto val = ans.mul_(100.0 / batch_size);
-	if (get_element_count(val) != 1)
-		throw std::runtime_error("Batch accuracy not correct");
-	return val[0].item<double>();
+torch::Tensor count_torch_correct(torch::Tensor output, torch::Tensor target)
+{
+	if (output.dim() != 2 || target.dim() < 1 || target.dim() > 2 || output.size(0) != target.size(0))
+		throw std::invalid_argument("Incompatible label dimensions");
+	if (get_element_count(target) != output.size(0))
+		throw std::invalid_argument("Element counts are unequal");
+	return output.argmax(1).eq(target.reshape({ -1 })).sum();
 }
 
 void assert_equal_content_count(torch::Tensor a, torch::Tensor b)
@@ -36,4 +28,18 @@ int get_element_count(torch::Tensor a)
 	for (int d = 1; d < a.dim(); ++d)
 		count *= a.size(d);
 	return count;
-}
\ No newline at end of file
+}
+std::vector<torch::data::Example<>> split_batch(torch::Tensor data, torch::Tensor target, int64_t chunkSize)
+{
+	auto batch_size = data.size(0);
+	if (chunkSize <= 0 || chunkSize >= batch_size)
+		return { torch::data::Example<>(data, target) };
+
+	std::vector<torch::data::Example<>> chunks;
+	for (int64_t first = 0; first < batch_size; first += chunkSize)
+	{
+		auto length = std::min(chunkSize, batch_size - first);
+		chunks.emplace_back(data.narrow(0, first, length), target.narrow(0, first, length));
+	}
+	return chunks;
+}
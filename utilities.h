@@ -1,36 +1,73 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <torch/torch.h>
 
-struct average_meter
+/// <summary>
+/// Running average whose sum stays a tensor on the device the values were computed on. update() only queues an
+/// addition, so accumulating a batch's accuracy or loss never waits for the device; the sum is copied to the host
+/// when getMean or getSum is called, i.e. when the results are printed or checkpointed. Counts are known on the host.
+/// </summary>
+struct device_meter
 {
-	average_meter(std::string name) : _name(name), _sum(0), _mean(0), _count(0) {}
-	average_meter() : average_meter("") {}
+	device_meter(std::string name) : _name(name), _count(0) {}
+	device_meter() : device_meter("") {}
 
 	void reset()
 	{
-		_sum = 0;
-		_mean = 0;
+		_sum = torch::Tensor();
 		_count = 0;
 	}
 
-	void update(long double value, bool incrementalUpdate = true, long long count = 1)
+	/// adds sum, a tensor holding the total of count samples' values, e.g. the number of correct predictions
+	void update(const torch::Tensor& sum, int64_t count)
 	{
-		if (!incrementalUpdate) this->reset();
-
+		auto value = sum.detach().to(torch::kDouble);
+		if (!_sum.defined()) _sum = value.clone();
+		else
+		{
+			// a sum restored from a checkpoint lives on the host until the first update
+			if (_sum.device() != value.device()) _sum = _sum.to(value.device());
+			_sum.add_(value);
+		}
 		_count += count;
-		_sum += count * value;
-		_mean = _sum / _count;
 	}
 
-	long double getMean() { return _mean; }
-	long double getSum() { return _sum; }
-	long double getCount() { return _count; }
+	/// folds the samples of another meter into this one, e.g. to combine per-thread meters
+	void merge(const device_meter& other)
+	{
+		if (other._sum.defined())
+		{
+			if (_sum.defined()) _sum.add_(other._sum.to(_sum.device()));
+			else _sum = other._sum.clone();
+		}
+		_count += other._count;
+	}
+
+	/// stores the meter under key so that training resumed from a checkpoint keeps averaging where it stopped
+	void save(torch::serialize::OutputArchive& archive, const std::string& key) const
+	{
+		archive.write(key + ".sum", c10::IValue(getSum()));
+		archive.write(key + ".count", c10::IValue(_count));
+	}
+
+	void load(torch::serialize::InputArchive& archive, const std::string& key)
+	{
+		c10::IValue sum, count;
+		archive.read(key + ".sum", sum);
+		archive.read(key + ".count", count);
+		_sum = torch::tensor(sum.toDouble(), torch::kDouble);
+		_count = count.toInt();
+	}
+
+	double getMean() const { return _count > 0 ? getSum() / _count : 0; }
+	double getSum() const { return _sum.defined() ? _sum.item<double>() : 0; }
+	int64_t getCount() const { return _count; }
 
 private:
 	std::string _name;
-	long double _sum, _mean;
-	long long _count;
+	torch::Tensor _sum;
+	int64_t _count;
 };
 
 /// returns the number of elements in the tensor
@@ -44,4 +81,14 @@ int get_element_count(torch::Tensor a);
 /// <param name="b"></param>
 void assert_equal_content_count(torch::Tensor a, torch::Tensor b);
 
-double calculate_torch_accuracy(torch::Tensor output, torch::Tensor target);
\ No newline at end of file
+/// percentage of rows of output whose largest logit is at the target label; synchronizes with the device
+double calculate_torch_accuracy(torch::Tensor output, torch::Tensor target);
+
+/// number of rows of output whose largest logit is at the target label, as a 0-dim tensor on output's device
+torch::Tensor count_torch_correct(torch::Tensor output, torch::Tensor target);
+
+/// <summary>
+/// Splits a batch into views of at most chunkSize consecutive samples, for running a large logical batch in
+/// memory-bounded pieces. A chunkSize of 0 or less returns the batch whole.
+/// </summary>
+std::vector<torch::data::Example<>> split_batch(torch::Tensor data, torch::Tensor target, int64_t chunkSize);
\ No newline at end of file
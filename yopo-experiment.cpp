@@ -1,20 +1,69 @@
 ﻿// yopo-experiment.cpp : Defines the entry point for the application.
 //
 #include "yopo-experiment.h"
+#include <cstdlib>
 #include <memory>
 #include <deque>
 #include "SmallCNN.h"
+#include "datasets.h"
 #include "Attackers/IAttacker.h"
 #include "Attackers/PGDAttacker.h"
 #include "Evaluator.h"
 #include "Loss.h"
 #include "Trainers/StandardTrainer.h"
 #include "Trainers/YOPOTrainer.h"
+#include "Trainers/FreeAdversarialTrainer.h"
+#include "Trainers/FastFGSMTrainer.h"
 #include "ExperimentRunner.h"
+#include "ExperimentScheduler.h"
+#include "DataParallel.h"
+#include "Profiler.h"
+#include "ModuleProfiler.h"
 
 namespace nn = torch::nn;
 namespace dt = torch::data;
 
+#ifndef _WIN32
+/// YOPO-5-3 on the CPU with every batch split between worker processes, one per NUMA node where there are enough
+void run_data_parallel_yopo(int workers)
+{
+	run_data_parallel(workers, [](SharedMemoryGroup& group) {
+		c10::Device device = c10::kCPU;
+		auto open_datasets = []() {
+			return std::make_pair(
+				MappedMNIST("D:/Projects/data/mnist", dt::datasets::MNIST::Mode::kTrain, "D:/Projects/data/mnist/train.yopo-store"),
+				MappedMNIST("D:/Projects/data/mnist", dt::datasets::MNIST::Mode::kTest, "D:/Projects/data/mnist/test.yopo-store"));
+		};
+		// rank 0 builds missing stores while the others wait, so that they only map them; the parent must not
+		// touch libtorch before forking, so it cannot build them itself
+		if (group.rank() == 0) open_datasets();
+		group.barrier();
+		auto datasets = open_datasets();
+		auto& mnist_training = datasets.first;
+		auto& mnist_test = datasets.second;
+
+		SmallCNN smcnn; smcnn->to(device);
+		auto state = smcnn->parameters();
+		for (auto& buffer : smcnn->buffers()) state.push_back(buffer);
+		group.broadcast(state);
+
+		std::shared_ptr<torch::optim::Optimizer> optimizer = std::make_shared<torch::optim::Adam>(smcnn->parameters());
+		auto trainer = std::make_shared<YOPOTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
+			smcnn, optimizer, torch::nn::CrossEntropyLoss(), 5, 3, 3.0 / 255.0, 6.0 / 255.0, device);
+		trainer->set_input_range(mnist_training.input_range().first, mnist_training.input_range().second);
+		trainer->set_gradient_synchronizer([&group, smcnn]() { group.all_reduce_gradients(smcnn->parameters()); });
+
+		std::string experimentName = "YOPO-5-3-DataParallel-" + std::to_string(group.world_size());
+		ExperimentRunner<SmallCNNImpl, MappedMNIST> experiment(
+			group.rank() == 0 ? experimentName : experimentName + "/rank" + std::to_string(group.rank()),
+			mnist_training, mnist_test, smcnn, trainer, 50, 100, device);
+		experiment.SetShard(group.rank(), group.world_size());
+		experiment.EnableCheckpoints(experimentName + ".ckpt", 100);
+		experiment.Run();
+	});
+}
+#endif
+
 int main() {
 	using OptimizerPtr = std::shared_ptr<torch::optim::Optimizer>;
 	using TrainerPtr = std::shared_ptr<ITrainer>;
@@ -23,11 +72,32 @@ int main() {
 
 
 	c10::Device DEVICE = c10::kCUDA;
+
+#ifndef _WIN32
+	// YOPO_DATA_PARALLEL=<workers> trains YOPO-5-3 on the CPU in that many processes instead; it forks, so it must
+	// run before anything else touches libtorch
+	if (const char* workers = std::getenv("YOPO_DATA_PARALLEL"))
+	{
+		run_data_parallel_yopo(std::max(1, std::atoi(workers)));
+		return 0;
+	}
+#endif
+
+	// YOPO_PROFILE=<trace.json> records phase timings and writes them as a Chrome trace when the run ends, and
+	// prints the per-module breakdown
+	const char* profilePath = std::getenv("YOPO_PROFILE");
+	if (profilePath)
+	{
+		Profiler::instance().enable();
+		ModuleProfiler::instance().enable();
+	}
 	std::deque<ExperimentRunnerPtr> experiments;
 
-	auto mnist_training = dt::datasets::MNIST("D:/Projects/data/mnist", dt::datasets::MNIST::Mode::kTrain)
-		.map(dt::transforms::Normalize<>(0.5, 0.5))
-		.map(dt::transforms::Stack<>());
+	auto mnist_training = MappedMNIST(
+		"D:/Projects/data/mnist", dt::datasets::MNIST::Mode::kTrain, "D:/Projects/data/mnist/train.yopo-store");
+
+	auto mnist_test = MappedMNIST(
+		"D:/Projects/data/mnist", dt::datasets::MNIST::Mode::kTest, "D:/Projects/data/mnist/test.yopo-store");
 
 	{
 		std::string experimentName = "PGD-Adversarial-1";
@@ -36,17 +106,79 @@ int main() {
 
 		OptimizerPtr optimizer = std::make_shared<torch::optim::Adam>(smcnn->parameters());
 
-		shared_ptr<IAttacker<SmallCNNImpl>> pgdattacker = std::make_shared<PGDAttacker<SmallCNNImpl>>(6.0 / 255.0, 3.0 / 255.0, 20, DEVICE);
+		auto pgd = std::make_shared<PGDAttacker<SmallCNNImpl>>(6.0 / 255.0, 3.0 / 255.0, 20, DEVICE, PGDExecutionMode::InPlace);
+		pgd->set_input_range(mnist_training.input_range().first, mnist_training.input_range().second);
+		shared_ptr<IAttacker<SmallCNNImpl>> pgdattacker = pgd;
 
 		TrainerPtr trainer = std::make_shared<StandardTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
 			smcnn, pgdattacker, optimizer, torch::nn::CrossEntropyLoss(), DEVICE);
 
-		ExperimentRunnerPtr experiment = std::make_shared<ExperimentRunner<SmallCNNImpl, decltype(mnist_training)>>(
-			experimentName, mnist_training, smcnn, trainer, 50, 100, DEVICE);
+		auto experiment = std::make_shared<ExperimentRunner<SmallCNNImpl, decltype(mnist_training)>>(
+			experimentName, mnist_training, mnist_test, smcnn, trainer, 50, 100, DEVICE);
+		experiment->EnableCheckpoints(experimentName + ".ckpt", 100);
+		experiments.push_back(experiment);
+	};
+
+	{
+		// every minibatch is replayed 8 times, so 50 / 8 epochs cost about as many passes as 50 epochs of clean training
+		std::string experimentName = "Free-Adversarial-8";
+		const int replays = 8;
+
+		SmallCNN smcnn; smcnn->to(DEVICE);
+
+		OptimizerPtr optimizer = std::make_shared<torch::optim::Adam>(smcnn->parameters());
+
+		auto freeTrainer = std::make_shared<FreeAdversarialTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
+			smcnn, optimizer, torch::nn::CrossEntropyLoss(), replays, 6.0 / 255.0, DEVICE);
+		freeTrainer->set_input_range(mnist_training.input_range().first, mnist_training.input_range().second);
+		TrainerPtr trainer = freeTrainer;
+
+		auto experiment = std::make_shared<ExperimentRunner<SmallCNNImpl, decltype(mnist_training)>>(
+			experimentName, mnist_training, mnist_test, smcnn, trainer, (50 + replays - 1) / replays, 100, DEVICE);
+		experiment->EnableCheckpoints(experimentName + ".ckpt", 100);
+		experiments.push_back(experiment);
+	};
+
+	{
+		// two passes per batch, plus a clean forward on every tenth; PGD-20 accuracy on the last 200 training images,
+		// which training leaves out and the test evaluation never sees, guards against catastrophic overfitting
+		std::string experimentName = "Fast-FGSM";
+
+		SmallCNN smcnn; smcnn->to(DEVICE);
+
+		OptimizerPtr optimizer = std::make_shared<torch::optim::Adam>(smcnn->parameters());
+
+		auto fastTrainer = std::make_shared<FastFGSMTrainer<SmallCNNImpl, nn::CrossEntropyLossImpl>>(
+			smcnn, optimizer, torch::nn::CrossEntropyLoss(), 6.0 / 255.0, DEVICE);
+		fastTrainer->set_input_range(mnist_training.input_range().first, mnist_training.input_range().second);
+		size_t heldOut = 200, trainingSize = mnist_training.size().value();
+		auto fastTraining = mnist_training.subset(0, trainingSize - heldOut);
+		auto checkSet = mnist_training.subset(trainingSize - heldOut, trainingSize);
+		auto checkAttacker = std::make_shared<PGDAttacker<SmallCNNImpl>>(6.0 / 255.0, 3.0 / 255.0, 20, DEVICE, PGDExecutionMode::InPlace);
+		checkAttacker->set_input_range(checkSet.input_range().first, checkSet.input_range().second);
+		fastTrainer->set_overfitting_check(
+			torch::data::Example<>(checkSet.images(), checkSet.targets()), checkAttacker, /*everyNBatches*/ 100);
+		TrainerPtr trainer = fastTrainer;
+
+		auto experiment = std::make_shared<ExperimentRunner<SmallCNNImpl, decltype(mnist_training)>>(
+			experimentName, fastTraining, mnist_test, smcnn, trainer, 50, 100, DEVICE);
+		experiment->EnableCheckpoints(experimentName + ".ckpt", 100);
 		experiments.push_back(experiment);
 	};
 
 
+	// split the machine evenly between the queued experiments, one intra-op thread per core; each starts as soon as
+	// its cores are free
+	int threadsPerExperiment = std::max<int>(1, std::thread::hardware_concurrency() / std::max<size_t>(1, experiments.size()));
+	ExperimentScheduler scheduler(threadsPerExperiment);
 	for (auto experiment : experiments)
-		experiment->Run();
+		scheduler.Enqueue(experiment, threadsPerExperiment);
+	scheduler.Run();
+
+	if (profilePath)
+	{
+		Profiler::instance().write_chrome_trace(profilePath);
+		std::cout << Profiler::instance().summary();
+		std::cout << ModuleProfiler::instance().summary();
+	}
 }